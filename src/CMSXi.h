@@ -33,6 +33,9 @@ enum CMSXi_Compressor
 	COMPRESS_RLE8     = 0b00110000, ///< Run-length encoding for all colors (8-bits for block length)
 	COMPRESS_RLEp     = 0b01000000, ///< Pattern based run-length encoding (6-bits for block length)
 	COMPRESS_RLE_Mask = 0b01110000, // Bits mask
+
+	// Adaptive compression
+	COMPRESS_Adaptive = 0b10000000, ///< Smallest compressor selected for each block (block data start with a 1-byte tag containing the block compressor ID)
 };
 
 /// Header structure
@@ -52,6 +52,72 @@ bool FileExists(const std::string& filename)
 	return false;
 }
 
+/// Get the output format from its command line name
+bool GetFileFormat(const c8* str, CMSX_FileFormat& format)
+{
+	if (CMSX::StrEqual(str, "auto"))
+		format = FORMAT_Auto;
+	else if (CMSX::StrEqual(str, "c"))
+		format = FORMAT_C;
+	else if (CMSX::StrEqual(str, "asm"))
+		format = FORMAT_Asm;
+	else if (CMSX::StrEqual(str, "bin"))
+		format = FORMAT_Bin;
+	else
+		return false;
+	return true;
+}
+
+/// Get the text data format from its command line name
+bool GetDataFormat(const c8* str, CMSX_DataFormat& format)
+{
+	if(CMSX::StrEqual(str, "dec"))
+		format = DATA_Decimal;
+	else if(CMSX::StrEqual(str, "hexa"))
+		format = DATA_Hexa;
+	else if(CMSX::StrEqual(str, "hexa0x"))
+		format = DATA_HexaC;
+	else if(CMSX::StrEqual(str, "hexaH"))
+		format = DATA_HexaASM;
+	else if(CMSX::StrEqual(str, "hexa$"))
+		format = DATA_HexaPascal;
+	else if (CMSX::StrEqual(str, "hexa&H"))
+		format = DATA_HexaBasic;
+	else if (CMSX::StrEqual(str, "hexa&"))
+		format = DATA_HexaAnd;
+	else if (CMSX::StrEqual(str, "hexa#"))
+		format = DATA_HexaSharp;
+	else if(CMSX::StrEqual(str, "bin"))
+		format = DATA_Binary;
+	else if (CMSX::StrEqual(str, "bin0b"))
+		format = DATA_BinaryC;
+	else if (CMSX::StrEqual(str, "binB"))
+		format = DATA_BinaryASM;
+	else
+		return false;
+	return true;
+}
+
+/// Create the exporter for the given output format (detected from the output file extension if format is auto)
+ExporterInterface* CreateExporter(CMSX_FileFormat outFormat, CMSX_DataFormat dataFormat, const std::string& outFile, ExportParameters* param)
+{
+	if((outFormat == FORMAT_C) || ((outFormat == FORMAT_Auto) && (HaveExt(outFile, ".h") || HaveExt(outFile, ".inc"))))
+		return new ExporterC(dataFormat, param, outFile);
+	else if((outFormat == FORMAT_Asm) || ((outFormat == FORMAT_Auto) && (HaveExt(outFile, ".s") || HaveExt(outFile, ".asm"))))
+		return new ExporterASM(dataFormat, param, outFile);
+	else if((outFormat == FORMAT_Bin) || ((outFormat == FORMAT_Auto) && (HaveExt(outFile, ".bin") || HaveExt(outFile, ".raw"))))
+		return new ExporterBin(dataFormat, param, outFile);
+	return NULL;
+}
+
+/// Additional output file (@see -also option)
+struct ExtraOutput
+{
+	std::string file;			///< Output filename
+	CMSX_FileFormat format;		///< Output format
+	CMSX_DataFormat data;		///< Data format to use for text export
+};
+
 /// Check if 2 string are equal
 //bool CMSX::StrEqual(const c8* str1, const c8* str2)
 //{
@@ -76,11 +142,16 @@ void PrintHelp()
 	printf("      c            C header file output\n");
 	printf("      asm          Assembler header file output\n");
 	printf("      bin          Raw binary data image\n");
+	printf("   -also f t d     Also export to another file from the same parsing (can be repeated)\n");
+	printf("                   f: Output file name\n");
+	printf("                   t: Output format (auto, c, asm or bin)\n");
+	printf("                   d: Text format for numbers (see -data)\n");
 	printf("   -name name      Name of the table to generate\n");
 	printf("   -mode ?         Exporter mode\n");
 	printf("      bmp          Export image as bitmap (default)\n");
 	printf("      gm1          Generate all tables for Graphic mode 1 (Screen 1)\n");
 	printf("      gm2          Generate all tables for Graphic mode 2 or 3 (Screen 2 or 4)\n");
+	printf("                   (one pattern/color bank per screen third if more than 256 unique patterns)\n");
 	printf("      sprt         Export 16x16 sprites with specific block ordering\n");
 	printf("   -pos x y        Start position in the input image\n");
 	printf("   -size x y       Width/height of a block to export (if 0, use image size)\n");
@@ -118,6 +189,7 @@ void PrintHelp()
 	printf("      rle4         Run-length encoding for all colors (4-bits for block length)\n");
 	printf("      rle8         Run-length encoding for all colors (8-bits for block length)\n");
 	printf("      rlep         Pattern based run-length encoding (6-bits for block length)\n");
+	printf("      adaptive     Select the smallest compressor for each block (1-byte compressor ID before each block)\n");
 	printf("      auto         Determine a good compression method according to parameters\n");
 	printf("      best         Search for best compressor according to input parameters (smallest data)\n");
 	printf("   -dither ?       Dithering method (for 1-bit color only)\n");
@@ -147,9 +219,12 @@ void PrintHelp()
 	printf("                   f/l: ASCII code of the first/last character to export\n");
 	printf("                        Can be character (like: &) or hexadecimal value (0xFF format)\n");
 	printf("   -offset x       Offset of layout index for GM1 et GM2 mode (default: 0)\n");
+	printf("   -tiles x        Maximum unique tiles per bank for GM2 mode (default: 0, no limit)\n");
+	printf("                   Near-duplicate tiles are merged to fit (lossy)\n");
 	printf("   -at x           Data starting address (can be decimal or hexadecimal starting with '0x')\n");
 	printf("   -def            Add defines for each table\n");
 	printf("   -notitle        Remove the ASCII-art title in top of exported text file\n");
+	printf("   -atomic         Write into a temporary file renamed to the output file once succeed\n");
 	printf("   -help           Display this help\n");
 }
 
@@ -192,7 +267,9 @@ int main(int argc, const char* argv[])
 	FreeImage_Initialise();
 
 	CMSX_FileFormat outFormat = FORMAT_Auto;
+	std::vector<ExtraOutput> extraOutputs;
 	ExportParameters param;
+	DecodedImage image;
 	i32 i;
 	bool bAutoCompress = false;
 	bool bBestCompress = false;
@@ -219,15 +296,25 @@ int main(int argc, const char* argv[])
 		}
 		else if (CMSX::StrEqual(argv[i], "-format")) // Output format
 		{
-			i++;
-			if (CMSX::StrEqual(argv[i], "auto"))
-				outFormat = FORMAT_Auto;
-			else if (CMSX::StrEqual(argv[i], "c"))
-				outFormat = FORMAT_C;
-			else if (CMSX::StrEqual(argv[i], "asm"))
-				outFormat = FORMAT_Asm;
-			else if (CMSX::StrEqual(argv[i], "bin"))
-				outFormat = FORMAT_Bin;
+			GetFileFormat(argv[++i], outFormat);
+		}
+		else if (CMSX::StrEqual(argv[i], "-also")) // Additional output
+		{
+			ExtraOutput extra;
+			extra.file = argv[++i];
+			extra.format = FORMAT_Auto;
+			extra.data = DATA_Hexa;
+			if (!GetFileFormat(argv[++i], extra.format))
+			{
+				printf("Error: Invalid output format for %s (%s)!\n", extra.file.c_str(), argv[i]);
+				return 1;
+			}
+			if (!GetDataFormat(argv[++i], extra.data))
+			{
+				printf("Error: Invalid data format for %s (%s)!\n", extra.file.c_str(), argv[i]);
+				return 1;
+			}
+			extraOutputs.push_back(extra);
 		}
 		else if(CMSX::StrEqual(argv[i], "-pos")) // Extract start position
 		{
@@ -302,6 +389,8 @@ int main(int argc, const char* argv[])
 				param.comp = COMPRESS_RLE8;
 			else if (CMSX::StrEqual(argv[i], "rlep"))
 				param.comp = COMPRESS_RLEp;
+			else if (CMSX::StrEqual(argv[i], "adaptive"))
+				param.comp = COMPRESS_Adaptive;
 			else if (CMSX::StrEqual(argv[i], "auto"))
 				bAutoCompress = true;
 			else if (CMSX::StrEqual(argv[i], "best"))
@@ -331,29 +420,7 @@ int main(int argc, const char* argv[])
 		}
 		else if(CMSX::StrEqual(argv[i], "-data")) // Text data format
 		{
-			i++;
-			if(CMSX::StrEqual(argv[i], "dec"))
-				param.format = DATA_Decimal;
-			else if(CMSX::StrEqual(argv[i], "hexa"))
-				param.format = DATA_Hexa;
-			else if(CMSX::StrEqual(argv[i], "hexa0x"))
-				param.format = DATA_HexaC;
-			else if(CMSX::StrEqual(argv[i], "hexaH"))
-				param.format = DATA_HexaASM;
-			else if(CMSX::StrEqual(argv[i], "hexa$"))
-				param.format = DATA_HexaPascal;
-			else if (CMSX::StrEqual(argv[i], "hexa&H"))
-				param.format = DATA_HexaBasic;
-			else if (CMSX::StrEqual(argv[i], "hexa&"))
-				param.format = DATA_HexaAnd;
-			else if (CMSX::StrEqual(argv[i], "hexa#"))
-				param.format = DATA_HexaSharp;
-			else if(CMSX::StrEqual(argv[i], "bin"))
-				param.format = DATA_Binary;
-			else if (CMSX::StrEqual(argv[i], "bin0b"))
-				param.format = DATA_BinaryC;
-			else if (CMSX::StrEqual(argv[i], "binB"))
-				param.format = DATA_BinaryASM;
+			GetDataFormat(argv[++i], param.format);
 		}
 		else if (CMSX::StrEqual(argv[i], "-mode")) // Exporter mode
 		{
@@ -413,6 +480,10 @@ int main(int argc, const char* argv[])
 			i++;
 			sscanf_s(argv[i], "%i", &param.startAddr);
 		}
+		else if (CMSX::StrEqual(argv[i], "-atomic")) // Temporary output file
+		{
+			param.bAtomic = true;
+		}
 		else if (CMSX::StrEqual(argv[i], "-def")) // Add C define
 		{
 			param.bDefine= true;
@@ -421,6 +492,10 @@ int main(int argc, const char* argv[])
 		{
 			param.offset = atoi(argv[++i]);
 		}
+		else if (CMSX::StrEqual(argv[i], "-tiles")) // Tiles budget
+		{
+			param.tileBudget = atoi(argv[++i]);
+		}
 		else if (CMSX::StrEqual(argv[i], "-notitle")) // Remove title
 		{
 			param.bTitle = false;
@@ -478,6 +553,16 @@ int main(int argc, const char* argv[])
 		else if (param.bpc == 4)
 			param.palCount = 15;
 	}
+	if ((param.bpc == 2) && (param.palCount > 3))
+	{
+		printf("Warning: -palcount is %i but can't be more than 3 with 2-bits color (color index 0 is always transparent). Continue with 3 as value.\n", param.palCount);
+		param.palCount = 3;
+	}
+	if ((param.bpc == 4) && (param.palCount > 15))
+	{
+		printf("Warning: -palcount is %i but can't be more than 15 with 4-bits color (color index 0 is always transparent). Continue with 15 as value.\n", param.palCount);
+		param.palCount = 15;
+	}
 
 	//-------------------------------------------------------------------------
 	// Determine a valid compression method according to input parameters
@@ -520,6 +605,10 @@ int main(int argc, const char* argv[])
 	// Search for best compressor according to input parameters
 	if (bBestCompress)
 	{
+		// Decode the input image once for all the benchmark passes (and the final export)
+		if (!DecodeImage(&param, &image))
+			return 1;
+
 		printf("Start benchmark to find the best compressor\n");
 		static const CMSXi_Compressor compTable[] =
 		{
@@ -532,9 +621,14 @@ int main(int argc, const char* argv[])
 			COMPRESS_CropLine256,
 			COMPRESS_RLE0,
 			COMPRESS_RLE4,
-			COMPRESS_RLE8
+			COMPRESS_RLE8,
+			COMPRESS_RLEp
 		};
 
+		// In bitmap mode, the size of every compressor is computed in a single pass (other modes need a full dry-run export)
+		u32 compSizes[numberof(compTable)];
+		bool bSizeKnown = (param.mode == MODE_Bitmap) && GetBitmapSizes(&param, &image, compTable, numberof(compTable), compSizes);
+
 		u32 bestSize = 0;
 		CMSXi_Compressor bestComp = COMPRESS_None;
 
@@ -544,14 +638,25 @@ int main(int argc, const char* argv[])
 			printf("- Check %s... ", GetCompressorName(param.comp, true));
 			if (IsCompressorCompatible(param.comp, param))
 			{
-				ExporterInterface* exp = new ExporterDummy(param.format, &param);
-				bool bSucceed = ParseImage(&param, exp);
+				u32 compSize = 0;
+				bool bSucceed = bSizeKnown;
+				if (bSizeKnown)
+				{
+					compSize = compSizes[i];
+				}
+				else
+				{
+					ExporterInterface* exp = new ExporterDummy(param.format, &param);
+					bSucceed = ParseImage(&param, &image, exp);
+					compSize = exp->GetTotalBytes();
+					delete exp;
+				}
 				if (bSucceed)
 				{
-					printf("Generated data: %i bytes\n", exp->GetTotalBytes());
-					if ((bestSize == 0) || (exp->GetTotalBytes() < bestSize))
+					printf("Generated data: %i bytes\n", compSize);
+					if ((bestSize == 0) || (compSize < bestSize))
 					{
-						bestSize = exp->GetTotalBytes();
+						bestSize = compSize;
 						bestComp = param.comp;
 					}
 				}
@@ -559,7 +664,6 @@ int main(int argc, const char* argv[])
 				{
 					printf("Parse error!\n");
 				}
-				delete exp;
 			}
 			else
 			{
@@ -626,7 +730,7 @@ int main(int argc, const char* argv[])
 		printf("Warning: RLE0 compressor can't be use without transparency color. RLE0 compressor removed.\n");
 		param.comp = COMPRESS_None;
 	}
-	if (((param.bpc == 1) || (param.bpc == 2)) && (param.comp & COMPRESS_RLE_Mask))
+	if (((param.bpc == 1) || (param.bpc == 2)) && (param.comp & COMPRESS_RLE_Mask) && (param.comp != COMPRESS_RLEp))
 	{
 		printf("Warning: RLE compressor can be use only with 4 and 8-bits color format. RLE compressor removed.\n");
 		param.comp = COMPRESS_None;
@@ -640,16 +744,6 @@ int main(int argc, const char* argv[])
 	{
 		printf("Warning: -skip as no effect without transparency color.\n");
 	}
-	if ((param.bpc == 2) && (param.palCount > 3))
-	{
-		printf("Warning: -palcount is %i but can't be more than 3 with 2-bits color (color index 0 is always transparent). Continue with 3 as value.\n", param.palCount);
-		param.palCount = 3;
-	}
-	if ((param.bpc == 4) && (param.palCount > 15))
-	{
-		printf("Warning: -palcount is %i but can't be more than 15 with 4-bits color (color index 0 is always transparent). Continue with 15 as value.\n", param.palCount);
-		param.palCount = 15;
-	}
 	if ((param.dither != DITHER_None) && (param.bpc != 1))
 	{
 		printf("Warning: Dithering only work with 1-bit color format (current is %i-bits). Dithering value will be ignored.\n", param.bpc);
@@ -662,29 +756,39 @@ int main(int argc, const char* argv[])
 	// Convert
 	if((param.inFile != "") && (param.outFile != ""))
 	{
-		if((outFormat == FORMAT_C) || ((outFormat == FORMAT_Auto) && (HaveExt(param.outFile, ".h") || HaveExt(param.outFile, ".inc"))))
-		{
-			ExporterInterface* exp = new ExporterC(param.format, &param);
-			bSucceed = ParseImage(&param, exp);
-			size = exp->GetTotalBytes();
-			delete exp;
-		}
-		else if((outFormat == FORMAT_Asm) || ((outFormat == FORMAT_Auto) && (HaveExt(param.outFile, ".s") || HaveExt(param.outFile, ".asm"))))
+		ExporterInterface* exp = CreateExporter(outFormat, param.format, param.outFile, &param);
+
+		// Forward the same parsing to all additional outputs
+		if ((exp != NULL) && !extraOutputs.empty())
 		{
-			ExporterInterface* exp = new ExporterASM(param.format, &param);
-			bSucceed = ParseImage(&param, exp);
-			size = exp->GetTotalBytes();
-			delete exp;
+			ExporterMulti* multi = new ExporterMulti(param.format, &param);
+			multi->Add(exp);
+			exp = multi;
+			for (u32 o = 0; o < extraOutputs.size(); o++)
+			{
+				ExporterInterface* extra = CreateExporter(extraOutputs[o].format, extraOutputs[o].data, extraOutputs[o].file, &param);
+				if (extra == NULL)
+				{
+					printf("Error: Unknown output format for %s!\n", extraOutputs[o].file.c_str());
+					delete exp;
+					return 1;
+				}
+				multi->Add(extra);
+			}
 		}
-		else if((outFormat == FORMAT_Bin) || ((outFormat == FORMAT_Auto) && (HaveExt(param.outFile, ".bin") || HaveExt(param.outFile, ".raw"))))
+
+		if (exp != NULL)
 		{
-			ExporterInterface* exp = new ExporterBin(param.format, &param);
-			bSucceed = ParseImage(&param, exp);
+			// Image may already have been decoded by the best compressor search
+			if ((image.bits != NULL) || DecodeImage(&param, &image))
+				bSucceed = ParseImage(&param, &image, exp);
 			size = exp->GetTotalBytes();
 			delete exp;
 		}
 		else
 		{
+			if (!extraOutputs.empty())
+				printf("Warning: -also can't be use with image output. Additional outputs will be ignored.\n");
 			FIBITMAP *dib = LoadImage(param.inFile.c_str()); // open and load the file using the default load option
 			if (dib == NULL)
 			{
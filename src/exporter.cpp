@@ -27,6 +27,7 @@ const char* GetCompressorName(CMSXi_Compressor comp, bool bShort)
 	case COMPRESS_RLE4:        return bShort ? "RLE4" :        "RLE4 (4-bits Run-length encoding)";
 	case COMPRESS_RLE8:        return bShort ? "RLE8" :        "RLE8 (8-bits Run-length encoding)";
 	case COMPRESS_RLEp:        return bShort ? "RLEp" :        "RLEp (6-bits Pattern based RLE)";
+	case COMPRESS_Adaptive:    return bShort ? "Adaptive" :    "Adaptive (Smallest compressor for each block)";
 	}
 	return "Unknow";
 }
@@ -62,7 +63,7 @@ bool IsCompressorCompatible(CMSXi_Compressor comp, const ExportParameters& param
 	if (comp == COMPRESS_None)
 		return true;
 
-	if ((param.bpc == 1) && (comp != COMPRESS_Crop16) && (comp != COMPRESS_Crop32) && (comp != COMPRESS_Crop256))
+	if ((param.bpc == 1) && (comp != COMPRESS_Crop16) && (comp != COMPRESS_Crop32) && (comp != COMPRESS_Crop256) && (comp != COMPRESS_RLEp))
 		return false;
 
 	if ((param.bpc == 8) && (comp == COMPRESS_RLE4))
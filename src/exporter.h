@@ -11,8 +11,10 @@
 #pragma once
 
 // std
+#include <string.h>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <ctime>
@@ -90,10 +92,12 @@ struct ExportParameters
 	u8 fontX;					///< Font width (can be equal or greater than sizeX)
 	u8 fontY;					///< Font height (can be equal or greater than sizeY)
 	u8 offset;					///< Offset of layout index for GM1 et GM2 mode
+	i32 tileBudget;				///< Maximum number of unique tiles per bank for GM2 mode; near-duplicate tiles are merged to fit (0: lossless)
 	bool bStartAddr;			///< Add starting address in the data definition
 	u32 startAddr;				///< Data starting adress
 	bool bDefine;				///< Add define block for C file that allow to add directive to table definition (to place data at a given address for e.g.)
 	bool bTitle;				///< Display ASCII-art title on top of exported text file
+	bool bAtomic;				///< Write into a temporary file renamed to the output filename once the export succeed
 	std::vector<Layer> layers;	///< Block layers
 
 	ExportParameters()
@@ -131,10 +135,12 @@ struct ExportParameters
 		fontX = 0;
 		fontY = 0;
 		offset = 0;
+		tileBudget = 0;
 		bDefine = false;
 		bStartAddr = false;
 		startAddr = 0;
 		bTitle = true;
+		bAtomic = false;
 	}
 };
 
@@ -162,27 +168,203 @@ protected:
 
 public:
 	ExporterInterface(CMSX_DataFormat f, ExportParameters* p): eFormat(f), Param(p), TotalBytes(0) {}
+	virtual ~ExporterInterface() {}
 	virtual void WriteHeader() = 0;
-	virtual void WriteTableBegin(TableFormat format, std::string name, std::string comment) = 0;
+	virtual void WriteTableBegin(TableFormat format, const std::string& name, const std::string& comment) = 0;
 	virtual void WriteSpriteHeader(i32 number) = 0;
-	virtual void WriteCommentLine(std::string comment) = 0;
-	virtual void Write1ByteLine(u8 a, std::string comment) = 0;
-	virtual void Write2BytesLine(u8 a, u8 b, std::string comment) = 0;
-	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, std::string comment) = 0;
-	virtual void Write1WordLine(u16 a, std::string comment) = 0;
-	virtual void Write2WordsLine(u16 a, u16 b, std::string comment) = 0;
+	virtual void WriteCommentLine(const std::string& comment) = 0;
+	virtual void Write1ByteLine(u8 a, const std::string& comment) = 0;
+	virtual void Write2BytesLine(u8 a, u8 b, const std::string& comment) = 0;
+	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, const std::string& comment) = 0;
+	virtual void Write1WordLine(u16 a, const std::string& comment) = 0;
+	virtual void Write2WordsLine(u16 a, u16 b, const std::string& comment) = 0;
 	virtual void WriteLineBegin() = 0;
 	virtual void Write1ByteData(u8 data) = 0;
 	virtual void Write8BitsData(u8 data) = 0;
 	virtual void WriteLineEnd() = 0;
-	virtual void WriteTableEnd(std::string comment) = 0;
+	virtual void WriteTableEnd(const std::string& comment) = 0;
+
+	/// Write several bytes of data in the current line (same as calling Write1ByteData for each byte)
+	virtual void WriteBytes(const u8* data, i32 count)
+	{
+		for (i32 i = 0; i < count; i++)
+			Write1ByteData(data[i]);
+	}
+	/// Write several 8-bits data in the current line (same as calling Write8BitsData for each byte)
+	virtual void WriteBits(const u8* data, i32 count)
+	{
+		for (i32 i = 0; i < count; i++)
+			Write8BitsData(data[i]);
+	}
+	/// Write a whole line of bytes data
+	virtual void WriteRow(const u8* data, i32 count)
+	{
+		WriteLineBegin();
+		WriteBytes(data, count);
+		WriteLineEnd();
+	}
 
 	virtual const c8* GetNumberFormat(u8 bytes = 1) = 0;
 
+	/// Tell if comments are written to the output (comment text don't need to be built otherwise)
+	virtual bool HasComments() const { return true; }
+
 	virtual u32 GetTotalBytes() { return TotalBytes; }
 	virtual bool Export() = 0;
 };
 
+/**
+ * Output file written block by block while the export runs
+ */
+class OutputFile
+{
+protected:
+	std::string Name;			///< Output filename
+	std::string TempName;		///< Filename being written (same as Name if not atomic)
+	FILE* File;
+	bool bError;
+
+public:
+	OutputFile() : File(NULL), bError(false) {}
+	~OutputFile() { Discard(); }
+
+	/// Set the output filename. If atomic, data are written in a temporary file renamed at Close()
+	void Init(const std::string& name, bool bAtomic)
+	{
+		Name = name;
+		TempName = bAtomic ? name + ".tmp" : name;
+	}
+	/// Write a block of data (the file is created at first write)
+	bool Write(const char* data, size_t size)
+	{
+		if (bError)
+			return false;
+		if (File == NULL)
+		{
+			if (fopen_s(&File, TempName.c_str(), "wb") != 0)
+			{
+				printf("Error: Fail to create %s\n", TempName.c_str());
+				File = NULL;
+				bError = true;
+				return false;
+			}
+		}
+		if ((size > 0) && (fwrite(data, 1, size, File) != size))
+		{
+			printf("Error: Fail to write %s\n", TempName.c_str());
+			bError = true;
+			return false;
+		}
+		return true;
+	}
+	/// Close the file and give it its final name
+	bool Close()
+	{
+		if (!Write(NULL, 0))
+			return false;
+		bool bClosed = (fclose(File) == 0);
+		File = NULL;
+		if (!bClosed)
+		{
+			printf("Error: Fail to write %s\n", TempName.c_str());
+			remove(TempName.c_str());
+			bError = true;
+			return false;
+		}
+		if (TempName != Name)
+		{
+			remove(Name.c_str()); // rename() fail on existing file with some C runtimes
+			if (rename(TempName.c_str(), Name.c_str()) != 0)
+			{
+				printf("Error: Fail to rename %s to %s\n", TempName.c_str(), Name.c_str());
+				remove(TempName.c_str());
+				bError = true;
+				return false;
+			}
+		}
+		return true;
+	}
+	/// Close and delete an uncompleted file (so no partial output is left behind)
+	void Discard()
+	{
+		if (File == NULL)
+			return;
+		fclose(File);
+		File = NULL;
+		remove(TempName.c_str());
+	}
+};
+
+/**
+ * Output buffer written through a bump pointer and flushed to its file each time it reach FLUSH_SIZE
+ */
+class OutputBuffer
+{
+protected:
+	std::vector<char> Data;
+	size_t Size;
+	OutputFile* Sink;
+
+public:
+	static const size_t FLUSH_SIZE = 64 * 1024;
+
+	OutputBuffer() : Size(0), Sink(NULL) {}
+
+	/// Set the file where data are flushed (without sink, the buffer grows to the whole output)
+	void SetSink(OutputFile* sink) { Sink = sink; }
+	/// Get a pointer where at least 'count' characters can be written (@see Commit)
+	char* Reserve(size_t count)
+	{
+		if ((Sink != NULL) && (Size + count > FLUSH_SIZE))
+			Flush();
+		if (Size + count > Data.size())
+			Data.resize(std::max(Data.size() * 2, Size + count + 4096));
+		return Data.data() + Size;
+	}
+	/// Validate the characters written up to the given pointer
+	void Commit(const char* end) { Size = end - Data.data(); }
+	/// Write the buffered data to the sink
+	bool Flush()
+	{
+		bool bOk = true;
+		if ((Sink != NULL) && (Size > 0))
+			bOk = Sink->Write(Data.data(), Size);
+		Size = 0;
+		return bOk;
+	}
+	void Append(const char* str, size_t len) { memcpy(Reserve(len), str, len); Size += len; }
+	void Push(u8 byte) { *Reserve(1) = (char)byte; Size++; }
+	OutputBuffer& operator += (const char* str) { Append(str, strlen(str)); return *this; }
+	OutputBuffer& operator += (const std::string& str) { Append(str.c_str(), str.size()); return *this; }
+	const char* GetData() const { return Data.data(); }
+	size_t GetSize() const { return Size; }
+};
+
+/**
+ * Text of each byte value in a given data format (formatted once at exporter creation)
+ */
+struct NumberText
+{
+	static const i32 MAX_LENGTH = 24;
+	char Text[256][MAX_LENGTH];
+	u8 Length[256];
+
+	void Build(const c8* format)
+	{
+		for (i32 i = 0; i < 256; i++)
+		{
+			sprintf_s(Text[i], MAX_LENGTH, format, i);
+			Length[i] = (u8)strlen(Text[i]);
+		}
+	}
+	/// Write the text of a value and return the end pointer
+	inline char* Write(char* dst, u8 value) const
+	{
+		memcpy(dst, Text[value], Length[value]);
+		return dst + Length[value];
+	}
+};
+
 /**
  * Text exporter interface
  */
@@ -191,10 +373,17 @@ class ExporterText : public ExporterInterface
 protected:
 	char strFormat[BUFFER_SIZE];
 	char strData[BUFFER_SIZE];
-	std::string outData;
+	OutputFile outFile;
+	OutputBuffer outData;
+	NumberText Numbers;
 
 public:
-	ExporterText(CMSX_DataFormat f, ExportParameters* p) : ExporterInterface(f, p) {}
+	ExporterText(CMSX_DataFormat f, ExportParameters* p, const std::string& file) : ExporterInterface(f, p)
+	{
+		Numbers.Build(CMSX_GetDataFormat(f, 1));
+		outFile.Init(file, p->bAtomic);
+		outData.SetSink(&outFile);
+	}
 	virtual void WriteHeader()
 	{
 		// Add title
@@ -253,19 +442,19 @@ public:
 			break;
 		};
 	}
-	virtual void WriteTableBegin(TableFormat format, std::string name, std::string comment) = 0;
+	virtual void WriteTableBegin(TableFormat format, const std::string& name, const std::string& comment) = 0;
 	virtual void WriteSpriteHeader(i32 number) = 0;
-	virtual void WriteCommentLine(std::string comment) = 0;
-	virtual void Write1ByteLine(u8 a, std::string comment) = 0;
-	virtual void Write2BytesLine(u8 a, u8 b, std::string comment) = 0;
-	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, std::string comment) = 0;
-	virtual void Write1WordLine(u16 a, std::string comment) = 0;
-	virtual void Write2WordsLine(u16 a, u16 b, std::string comment) = 0;
+	virtual void WriteCommentLine(const std::string& comment) = 0;
+	virtual void Write1ByteLine(u8 a, const std::string& comment) = 0;
+	virtual void Write2BytesLine(u8 a, u8 b, const std::string& comment) = 0;
+	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, const std::string& comment) = 0;
+	virtual void Write1WordLine(u16 a, const std::string& comment) = 0;
+	virtual void Write2WordsLine(u16 a, u16 b, const std::string& comment) = 0;
 	virtual void WriteLineBegin() = 0;
 	virtual void Write1ByteData(u8 data) = 0;
 	virtual void Write8BitsData(u8 data) = 0;
 	virtual void WriteLineEnd() = 0;
-	virtual void WriteTableEnd(std::string comment) = 0;
+	virtual void WriteTableEnd(const std::string& comment) = 0;
 
 	virtual const c8* GetNumberFormat(u8 bytes = 1)
 	{
@@ -274,16 +463,10 @@ public:
 
 	virtual bool Export()
 	{
-		// Write header file
-		FILE* file;
-		if (fopen_s(&file, Param->outFile.c_str(), "wb") != 0)
-		{
-			printf("Error: Fail to create %s\n", Param->outFile.c_str());
+		// Write remaining data and close the file
+		if (!outData.Flush())
 			return false;
-		}
-		fwrite(outData.c_str(), 1, outData.size(), file);
-		fclose(file);
-		return true;
+		return outFile.Close();
 	}
 };
 	
@@ -293,9 +476,9 @@ public:
 class ExporterC: public ExporterText
 {
 public:
-	ExporterC(CMSX_DataFormat f, ExportParameters* p): ExporterText(f, p) {}
+	ExporterC(CMSX_DataFormat f, ExportParameters* p, const std::string& file): ExporterText(f, p, file) {}
 
-	virtual void WriteTableBegin(TableFormat format, std::string name, std::string comment)
+	virtual void WriteTableBegin(TableFormat format, const std::string& name, const std::string& comment)
 	{
 		if (Param->bStartAddr)
 		{
@@ -337,13 +520,13 @@ public:
 		outData += strData;
 	}
 
-	virtual void WriteCommentLine(std::string comment)
+	virtual void WriteCommentLine(const std::string& comment)
 	{
 		sprintf_s(strData, BUFFER_SIZE,	"// %s\n", comment.c_str());
 		outData += strData;
 	}
 
-	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, std::string comment)
+	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, const std::string& comment)
 	{
 		sprintf_s(strFormat, BUFFER_SIZE, 
 			"\t%s, %s, %s, %s, // %s\n", GetNumberFormat(), GetNumberFormat(), GetNumberFormat(), GetNumberFormat(), comment.c_str());
@@ -352,7 +535,7 @@ public:
 		TotalBytes += 4;
 	}
 
-	virtual void Write2BytesLine(u8 a, u8 b, std::string comment)
+	virtual void Write2BytesLine(u8 a, u8 b, const std::string& comment)
 	{
 		sprintf_s(strFormat, BUFFER_SIZE, 
 			"\t%s, %s, // %s\n", GetNumberFormat(), GetNumberFormat(), comment.c_str());
@@ -361,7 +544,7 @@ public:
 		TotalBytes += 2;
 	}
 
-	virtual void Write1ByteLine(u8 a, std::string comment)
+	virtual void Write1ByteLine(u8 a, const std::string& comment)
 	{
 		sprintf_s(strFormat, BUFFER_SIZE, 
 			"\t%s, // %s\n", GetNumberFormat(), comment.c_str());
@@ -370,7 +553,7 @@ public:
 		TotalBytes += 1;
 	}
 
-	virtual void Write1WordLine(u16 a, std::string comment)
+	virtual void Write1WordLine(u16 a, const std::string& comment)
 	{ 
 		sprintf_s(strFormat, BUFFER_SIZE,
 			"\t%s, // %s\n", GetNumberFormat(2), comment.c_str());
@@ -379,7 +562,7 @@ public:
 		TotalBytes += 2;
 	}
 
-	virtual void Write2WordsLine(u16 a, u16 b, std::string comment)
+	virtual void Write2WordsLine(u16 a, u16 b, const std::string& comment)
 	{
 		sprintf_s(strFormat, BUFFER_SIZE,
 			"\t%s, %s, // %s\n", GetNumberFormat(2), GetNumberFormat(2), comment.c_str());
@@ -395,35 +578,47 @@ public:
 
 	virtual void Write1ByteData(u8 data)
 	{
-		sprintf_s(strFormat, BUFFER_SIZE, "%s, ", GetNumberFormat());
-		sprintf_s(strData, BUFFER_SIZE, strFormat, data);
-		outData += strData;
+		char* ptr = outData.Reserve(NumberText::MAX_LENGTH + 2);
+		ptr = Numbers.Write(ptr, data);
+		*ptr++ = ',';
+		*ptr++ = ' ';
+		outData.Commit(ptr);
 		TotalBytes += 1;
 	}
 
 	virtual void Write8BitsData(u8 data)
 	{
-		sprintf_s(strFormat, BUFFER_SIZE, 
-			"%s, /* %%c%%c%%c%%c%%c%%c%%c%%c */ ", GetNumberFormat());
-		sprintf_s(strData, BUFFER_SIZE, strFormat, data, 
-			data & 0x80 ? '#' : '.', 
-			data & 0x40 ? '#' : '.', 
-			data & 0x20 ? '#' : '.', 
-			data & 0x10 ? '#' : '.', 
-			data & 0x08 ? '#' : '.', 
-			data & 0x04 ? '#' : '.', 
-			data & 0x02 ? '#' : '.', 
-			data & 0x01 ? '#' : '.');
-		outData += strData;
+		char* ptr = outData.Reserve(NumberText::MAX_LENGTH + 18);
+		ptr = Numbers.Write(ptr, data);
+		memcpy(ptr, ", /* ", 5);
+		ptr += 5;
+		for (i32 i = 7; i >= 0; i--)
+			*ptr++ = (data & (1 << i)) ? '#' : '.';
+		memcpy(ptr, " */ ", 4);
+		ptr += 4;
+		outData.Commit(ptr);
 		TotalBytes += 1;
 	}
 
+	virtual void WriteBytes(const u8* data, i32 count)
+	{
+		char* ptr = outData.Reserve(count * (NumberText::MAX_LENGTH + 2));
+		for (i32 i = 0; i < count; i++)
+		{
+			ptr = Numbers.Write(ptr, data[i]);
+			*ptr++ = ',';
+			*ptr++ = ' ';
+		}
+		outData.Commit(ptr);
+		TotalBytes += count;
+	}
+
 	virtual void WriteLineEnd()
 	{ 
 		outData += "\n";
 	}
 
-	virtual void WriteTableEnd(std::string comment)
+	virtual void WriteTableEnd(const std::string& comment)
 	{
 		outData += "};\n";
 		if (comment != "")
@@ -442,9 +637,9 @@ public:
 class ExporterASM: public ExporterText
 {
 public:
-	ExporterASM(CMSX_DataFormat f, ExportParameters* p): ExporterText(f, p) {}
+	ExporterASM(CMSX_DataFormat f, ExportParameters* p, const std::string& file): ExporterText(f, p, file) {}
 
-	virtual void WriteTableBegin(TableFormat format, std::string name, std::string comment)
+	virtual void WriteTableBegin(TableFormat format, const std::string& name, const std::string& comment)
 	{
 		sprintf_s(strData, BUFFER_SIZE,
 			"\n"
@@ -461,13 +656,13 @@ public:
 		outData += strData;
 	}
 
-	virtual void WriteCommentLine(std::string comment)
+	virtual void WriteCommentLine(const std::string& comment)
 	{
 		sprintf_s(strData, BUFFER_SIZE, "; %s\n", comment.c_str());
 		outData += strData;
 	}
 
-	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, std::string comment)
+	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, const std::string& comment)
 	{
 		sprintf_s(strFormat, BUFFER_SIZE, 
 			"\t.db %s %s %s %s ; %s\n", GetNumberFormat(), GetNumberFormat(), GetNumberFormat(), GetNumberFormat(), comment.c_str());
@@ -476,7 +671,7 @@ public:
 		TotalBytes += 4;
 	}
 
-	virtual void Write2BytesLine(u8 a, u8 b, std::string comment)
+	virtual void Write2BytesLine(u8 a, u8 b, const std::string& comment)
 	{
 		sprintf_s(strFormat, BUFFER_SIZE, 
 			"\t.db %s %s ; %s\n", GetNumberFormat(), GetNumberFormat(), comment.c_str());
@@ -485,7 +680,7 @@ public:
 		TotalBytes += 2;
 	}
 
-	virtual void Write1ByteLine(u8 a, std::string comment)
+	virtual void Write1ByteLine(u8 a, const std::string& comment)
 	{
 		sprintf_s(strFormat, BUFFER_SIZE, 
 			"\t.db %s ; %s\n", GetNumberFormat(), comment.c_str());
@@ -494,7 +689,7 @@ public:
 		TotalBytes += 1;
 	}
 
-	virtual void Write1WordLine(u16 a, std::string comment)
+	virtual void Write1WordLine(u16 a, const std::string& comment)
 	{
 		sprintf_s(strFormat, BUFFER_SIZE,
 			"\t.dw %s ; %s\n", GetNumberFormat(2), comment.c_str());
@@ -503,7 +698,7 @@ public:
 		TotalBytes += 2;
 	}
 
-	virtual void Write2WordsLine(u16 a, u16 b, std::string comment)
+	virtual void Write2WordsLine(u16 a, u16 b, const std::string& comment)
 	{
 		sprintf_s(strFormat, BUFFER_SIZE,
 			"\t.dw %s %s ; %s\n", GetNumberFormat(), GetNumberFormat(), comment.c_str());
@@ -519,18 +714,33 @@ public:
 
 	virtual void Write1ByteData(u8 data)
 	{
-		sprintf_s(strFormat, BUFFER_SIZE, "%s ", GetNumberFormat());
-		sprintf_s(strData, BUFFER_SIZE, strFormat, data);
-		outData += strData;
+		char* ptr = outData.Reserve(NumberText::MAX_LENGTH + 1);
+		ptr = Numbers.Write(ptr, data);
+		*ptr++ = ' ';
+		outData.Commit(ptr);
 		TotalBytes += 1;
 	}
 
 	virtual void Write8BitsData(u8 data)
 	{
-		sprintf_s(strFormat, BUFFER_SIZE, "%s ", GetNumberFormat());
-		sprintf_s(strData, BUFFER_SIZE, strFormat, data);
-		outData += strData;
-		TotalBytes += 1;
+		Write1ByteData(data);
+	}
+
+	virtual void WriteBytes(const u8* data, i32 count)
+	{
+		char* ptr = outData.Reserve(count * (NumberText::MAX_LENGTH + 1));
+		for (i32 i = 0; i < count; i++)
+		{
+			ptr = Numbers.Write(ptr, data[i]);
+			*ptr++ = ' ';
+		}
+		outData.Commit(ptr);
+		TotalBytes += count;
+	}
+
+	virtual void WriteBits(const u8* data, i32 count)
+	{
+		WriteBytes(data, count);
 	}
 
 	virtual void WriteLineEnd()
@@ -538,7 +748,7 @@ public:
 		outData += "\n";
 	}
 
-	virtual void WriteTableEnd(std::string comment)
+	virtual void WriteTableEnd(const std::string& comment)
 	{
 		if (comment != "")
 		{
@@ -556,75 +766,82 @@ class ExporterBin: public ExporterInterface
 {
 protected:
 #define BUFFER_SIZE 1024
-	std::vector<u8> outData;
+	OutputFile outFile;
+	OutputBuffer outData;
 
 public:
-	ExporterBin(CMSX_DataFormat f, ExportParameters* p) : ExporterInterface(f, p) {}
+	ExporterBin(CMSX_DataFormat f, ExportParameters* p, const std::string& file) : ExporterInterface(f, p)
+	{
+		outFile.Init(file, p->bAtomic);
+		outData.SetSink(&outFile);
+	}
 	virtual void WriteHeader() {}
-	virtual void WriteTableBegin(TableFormat format, std::string name, std::string comment) {}
+	virtual void WriteTableBegin(TableFormat format, const std::string& name, const std::string& comment) {}
 	virtual void WriteSpriteHeader(i32 number) {}
-	virtual void WriteCommentLine(std::string comment) {}
-	virtual void Write1ByteLine(u8 a, std::string comment)
+	virtual void WriteCommentLine(const std::string& comment) {}
+	virtual void Write1ByteLine(u8 a, const std::string& comment)
 	{ 
-		outData.push_back(a); 
+		outData.Push(a); 
 		TotalBytes += 1;
 	}
-	virtual void Write2BytesLine(u8 a, u8 b, std::string comment)
+	virtual void Write2BytesLine(u8 a, u8 b, const std::string& comment)
 	{ 
-		outData.push_back(a); 
-		outData.push_back(b); 
+		outData.Push(a); 
+		outData.Push(b); 
 		TotalBytes += 2;
 	}
-	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, std::string comment)
+	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, const std::string& comment)
 	{ 
-		outData.push_back(a); 
-		outData.push_back(b); 
-		outData.push_back(c); 
-		outData.push_back(d); 
+		outData.Push(a); 
+		outData.Push(b); 
+		outData.Push(c); 
+		outData.Push(d); 
 		TotalBytes += 4;
 	}
-	virtual void Write1WordLine(u16 a, std::string comment)
+	virtual void Write1WordLine(u16 a, const std::string& comment)
 	{
-		outData.push_back(a & 0x00FF);
-		outData.push_back(a >> 8);
+		outData.Push(a & 0x00FF);
+		outData.Push(a >> 8);
 		TotalBytes += 2;
 	}
-	virtual void Write2WordsLine(u16 a, u16 b, std::string comment)
+	virtual void Write2WordsLine(u16 a, u16 b, const std::string& comment)
 	{
-		outData.push_back(a & 0x00FF);
-		outData.push_back(a >> 8);
-		outData.push_back(b & 0x00FF);
-		outData.push_back(b >> 8);
+		outData.Push(a & 0x00FF);
+		outData.Push(a >> 8);
+		outData.Push(b & 0x00FF);
+		outData.Push(b >> 8);
 		TotalBytes += 4;
 	}
 	virtual void WriteLineBegin() {}
 	virtual void Write1ByteData(u8 data)
 	{ 
-		outData.push_back(data);
+		outData.Push(data);
 		TotalBytes += 1;
 	}
 	virtual void Write8BitsData(u8 data)
 	{ 
-		outData.push_back(data);
+		outData.Push(data);
 		TotalBytes += 1;
 	}
 	virtual void WriteLineEnd() {}
-	virtual void WriteTableEnd(std::string comment) {}
+	virtual void WriteTableEnd(const std::string& comment) {}
+	virtual void WriteBytes(const u8* data, i32 count)
+	{
+		outData.Append((const char*)data, count);
+		TotalBytes += count;
+	}
+	virtual void WriteBits(const u8* data, i32 count) { WriteBytes(data, count); }
+	virtual void WriteRow(const u8* data, i32 count) { WriteBytes(data, count); }
+	virtual bool HasComments() const { return false; }
 
 	virtual const c8* GetNumberFormat(u8 bytes = 1) { return NULL; }
 
 	virtual bool Export()
 	{
-		// Write header file
-		FILE* file;
-		if (fopen_s(&file, Param->outFile.c_str(), "wb") != 0)
-		{
-			printf("Error: Fail to create %s\n", Param->outFile.c_str());
+		// Write remaining data and close the file
+		if (!outData.Flush())
 			return false;
-		}
-		fwrite(outData.data(), 1, outData.size(), file);
-		fclose(file);
-		return true;
+		return outFile.Close();
 	}
 };
 
@@ -637,20 +854,214 @@ class ExporterDummy : public ExporterInterface
 public:
 	ExporterDummy(CMSX_DataFormat f, ExportParameters* p) : ExporterInterface(f, p) {}
 	virtual void WriteHeader() {}
-	virtual void WriteTableBegin(TableFormat format, std::string name, std::string comment) {}
+	virtual void WriteTableBegin(TableFormat format, const std::string& name, const std::string& comment) {}
 	virtual void WriteSpriteHeader(i32 number) {}
-	virtual void WriteCommentLine(std::string comment) {}
-	virtual void Write1ByteLine(u8 a, std::string comment) { TotalBytes += 1; }
-	virtual void Write2BytesLine(u8 a, u8 b, std::string comment) { TotalBytes += 2; }
-	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, std::string comment) { TotalBytes += 4; }
-	virtual void Write1WordLine(u16 a, std::string comment) { TotalBytes += 2; }
-	virtual void Write2WordsLine(u16 a, u16 b, std::string comment) { TotalBytes += 4; }
+	virtual void WriteCommentLine(const std::string& comment) {}
+	virtual void Write1ByteLine(u8 a, const std::string& comment) { TotalBytes += 1; }
+	virtual void Write2BytesLine(u8 a, u8 b, const std::string& comment) { TotalBytes += 2; }
+	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, const std::string& comment) { TotalBytes += 4; }
+	virtual void Write1WordLine(u16 a, const std::string& comment) { TotalBytes += 2; }
+	virtual void Write2WordsLine(u16 a, u16 b, const std::string& comment) { TotalBytes += 4; }
 	virtual void WriteLineBegin() {}
 	virtual void Write1ByteData(u8 data) { TotalBytes += 1; }
 	virtual void Write8BitsData(u8 data) { TotalBytes += 1;	}
 	virtual void WriteLineEnd() {}
-	virtual void WriteTableEnd(std::string comment) {}
+	virtual void WriteTableEnd(const std::string& comment) {}
+	virtual void WriteBytes(const u8* data, i32 count) { TotalBytes += count; }
+	virtual void WriteBits(const u8* data, i32 count) { TotalBytes += count; }
+	virtual void WriteRow(const u8* data, i32 count) { TotalBytes += count; }
+	virtual bool HasComments() const { return false; }
 	virtual const c8* GetNumberFormat(u8 bytes = 1) { return NULL; }
 	virtual bool Export() { return true; }
 };
 
+/**
+ * Recorder exporter (store write calls to replay them later into another exporter)
+ */
+class ExporterRecorder : public ExporterInterface
+{
+protected:
+	/// Recorded command type
+	enum CommandType
+	{
+		CMD_Header,
+		CMD_TableBegin,
+		CMD_SpriteHeader,
+		CMD_CommentLine,
+		CMD_1ByteLine,
+		CMD_2BytesLine,
+		CMD_4BytesLine,
+		CMD_1WordLine,
+		CMD_2WordsLine,
+		CMD_LineBegin,
+		CMD_1ByteData,
+		CMD_8BitsData,
+		CMD_LineEnd,
+		CMD_TableEnd,
+		CMD_Bytes,
+		CMD_Bits,
+		CMD_Row,
+	};
+
+	/// Recorded command
+	struct Command
+	{
+		CommandType type;
+		u32 value[4];
+		u32 name;		///< Index of the name in texts (0: empty)
+		u32 comment;	///< Index of the comment in texts (0: empty)
+	};
+
+	std::vector<Command> commands;
+	std::vector<u8> bytes; ///< Data of the bulk commands (value[0]: offset, value[1]: count)
+	std::vector<std::string> texts; ///< Names and comments of the commands (only stored when not empty)
+	bool bComments; ///< Record comments (should match the exporter the commands will be replayed to)
+
+	void Record(CommandType type, u32 a = 0, u32 b = 0, u32 c = 0, u32 d = 0, const std::string& name = "", const std::string& comment = "")
+	{
+		Command cmd;
+		cmd.type = type;
+		cmd.value[0] = a;
+		cmd.value[1] = b;
+		cmd.value[2] = c;
+		cmd.value[3] = d;
+		cmd.name = AddText(name);
+		cmd.comment = bComments ? AddText(comment) : 0;
+		commands.push_back(cmd);
+	}
+
+	u32 AddText(const std::string& str)
+	{
+		if (str.empty())
+			return 0;
+		texts.push_back(str);
+		return (u32)texts.size() - 1;
+	}
+
+	void RecordBytes(CommandType type, const u8* data, i32 count)
+	{
+		Record(type, (u32)bytes.size(), count);
+		bytes.insert(bytes.end(), data, data + count);
+		TotalBytes += count;
+	}
+
+public:
+	ExporterRecorder(CMSX_DataFormat f, ExportParameters* p, bool comments = true) : ExporterInterface(f, p), texts(1), bComments(comments) {}
+	virtual void WriteHeader() { Record(CMD_Header); }
+	virtual void WriteTableBegin(TableFormat format, const std::string& name, const std::string& comment) { Record(CMD_TableBegin, format, 0, 0, 0, name, comment); }
+	virtual void WriteSpriteHeader(i32 number) { Record(CMD_SpriteHeader, number); }
+	virtual void WriteCommentLine(const std::string& comment) { Record(CMD_CommentLine, 0, 0, 0, 0, "", comment); }
+	virtual void Write1ByteLine(u8 a, const std::string& comment) { Record(CMD_1ByteLine, a, 0, 0, 0, "", comment); TotalBytes += 1; }
+	virtual void Write2BytesLine(u8 a, u8 b, const std::string& comment) { Record(CMD_2BytesLine, a, b, 0, 0, "", comment); TotalBytes += 2; }
+	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, const std::string& comment) { Record(CMD_4BytesLine, a, b, c, d, "", comment); TotalBytes += 4; }
+	virtual void Write1WordLine(u16 a, const std::string& comment) { Record(CMD_1WordLine, a, 0, 0, 0, "", comment); TotalBytes += 2; }
+	virtual void Write2WordsLine(u16 a, u16 b, const std::string& comment) { Record(CMD_2WordsLine, a, b, 0, 0, "", comment); TotalBytes += 4; }
+	virtual void WriteLineBegin() { Record(CMD_LineBegin); }
+	virtual void Write1ByteData(u8 data) { Record(CMD_1ByteData, data); TotalBytes += 1; }
+	virtual void Write8BitsData(u8 data) { Record(CMD_8BitsData, data); TotalBytes += 1; }
+	virtual void WriteLineEnd() { Record(CMD_LineEnd); }
+	virtual void WriteTableEnd(const std::string& comment) { Record(CMD_TableEnd, 0, 0, 0, 0, "", comment); }
+	virtual void WriteBytes(const u8* data, i32 count) { RecordBytes(CMD_Bytes, data, count); }
+	virtual void WriteBits(const u8* data, i32 count) { RecordBytes(CMD_Bits, data, count); }
+	virtual void WriteRow(const u8* data, i32 count) { RecordBytes(CMD_Row, data, count); }
+	virtual bool HasComments() const { return bComments; }
+	virtual const c8* GetNumberFormat(u8 bytes = 1) { return NULL; }
+	virtual bool Export() { return true; }
+
+	/// Remove all recorded commands (allocated memory is kept for the next recording)
+	void Clear()
+	{
+		commands.clear();
+		bytes.clear();
+		texts.resize(1);
+		TotalBytes = 0;
+	}
+
+	/// Replay all recorded commands into the given exporter
+	void Replay(ExporterInterface* exp) const
+	{
+		for (u32 i = 0; i < commands.size(); i++)
+		{
+			const Command& cmd = commands[i];
+			const std::string& name = texts[cmd.name];
+			const std::string& comment = texts[cmd.comment];
+			switch (cmd.type)
+			{
+			case CMD_Header:       exp->WriteHeader(); break;
+			case CMD_TableBegin:   exp->WriteTableBegin((TableFormat)cmd.value[0], name, comment); break;
+			case CMD_SpriteHeader: exp->WriteSpriteHeader((i32)cmd.value[0]); break;
+			case CMD_CommentLine:  exp->WriteCommentLine(comment); break;
+			case CMD_1ByteLine:    exp->Write1ByteLine((u8)cmd.value[0], comment); break;
+			case CMD_2BytesLine:   exp->Write2BytesLine((u8)cmd.value[0], (u8)cmd.value[1], comment); break;
+			case CMD_4BytesLine:   exp->Write4BytesLine((u8)cmd.value[0], (u8)cmd.value[1], (u8)cmd.value[2], (u8)cmd.value[3], comment); break;
+			case CMD_1WordLine:    exp->Write1WordLine((u16)cmd.value[0], comment); break;
+			case CMD_2WordsLine:   exp->Write2WordsLine((u16)cmd.value[0], (u16)cmd.value[1], comment); break;
+			case CMD_LineBegin:    exp->WriteLineBegin(); break;
+			case CMD_1ByteData:    exp->Write1ByteData((u8)cmd.value[0]); break;
+			case CMD_8BitsData:    exp->Write8BitsData((u8)cmd.value[0]); break;
+			case CMD_LineEnd:      exp->WriteLineEnd(); break;
+			case CMD_TableEnd:     exp->WriteTableEnd(comment); break;
+			case CMD_Bytes:        exp->WriteBytes(bytes.data() + cmd.value[0], (i32)cmd.value[1]); break;
+			case CMD_Bits:         exp->WriteBits(bytes.data() + cmd.value[0], (i32)cmd.value[1]); break;
+			case CMD_Row:          exp->WriteRow(bytes.data() + cmd.value[0], (i32)cmd.value[1]); break;
+			}
+		}
+	}
+};
+
+/**
+ * Fan-out exporter forwarding each command to several exporters (to get many output files from a single parsing)
+ */
+class ExporterMulti : public ExporterInterface
+{
+protected:
+	std::vector<ExporterInterface*> Exporters;
+
+public:
+	ExporterMulti(CMSX_DataFormat f, ExportParameters* p) : ExporterInterface(f, p) {}
+	virtual ~ExporterMulti()
+	{
+		for (u32 i = 0; i < Exporters.size(); i++)
+			delete Exporters[i];
+	}
+
+	/// Add an output exporter (the fan-out exporter take ownership of it)
+	void Add(ExporterInterface* exp) { Exporters.push_back(exp); }
+
+	virtual void WriteHeader() { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteHeader(); }
+	virtual void WriteTableBegin(TableFormat format, const std::string& name, const std::string& comment) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteTableBegin(format, name, comment); }
+	virtual void WriteSpriteHeader(i32 number) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteSpriteHeader(number); }
+	virtual void WriteCommentLine(const std::string& comment) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteCommentLine(comment); }
+	virtual void Write1ByteLine(u8 a, const std::string& comment) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->Write1ByteLine(a, comment); }
+	virtual void Write2BytesLine(u8 a, u8 b, const std::string& comment) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->Write2BytesLine(a, b, comment); }
+	virtual void Write4BytesLine(u8 a, u8 b, u8 c, u8 d, const std::string& comment) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->Write4BytesLine(a, b, c, d, comment); }
+	virtual void Write1WordLine(u16 a, const std::string& comment) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->Write1WordLine(a, comment); }
+	virtual void Write2WordsLine(u16 a, u16 b, const std::string& comment) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->Write2WordsLine(a, b, comment); }
+	virtual void WriteLineBegin() { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteLineBegin(); }
+	virtual void Write1ByteData(u8 data) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->Write1ByteData(data); }
+	virtual void Write8BitsData(u8 data) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->Write8BitsData(data); }
+	virtual void WriteLineEnd() { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteLineEnd(); }
+	virtual void WriteTableEnd(const std::string& comment) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteTableEnd(comment); }
+	virtual void WriteBytes(const u8* data, i32 count) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteBytes(data, count); }
+	virtual void WriteBits(const u8* data, i32 count) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteBits(data, count); }
+	virtual void WriteRow(const u8* data, i32 count) { for (u32 i = 0; i < Exporters.size(); i++) Exporters[i]->WriteRow(data, count); }
+	virtual const c8* GetNumberFormat(u8 bytes = 1) { return NULL; }
+
+	/// Comments are needed if any of the exporters write them
+	virtual bool HasComments() const
+	{
+		for (u32 i = 0; i < Exporters.size(); i++)
+			if (Exporters[i]->HasComments())
+				return true;
+		return false;
+	}
+	/// All exporters receive the same data so they share the same size
+	virtual u32 GetTotalBytes() { return Exporters.empty() ? 0 : Exporters[0]->GetTotalBytes(); }
+	virtual bool Export()
+	{
+		bool bSaved = true;
+		for (u32 i = 0; i < Exporters.size(); i++)
+			bSaved = Exporters[i]->Export() && bSaved;
+		return bSaved;
+	}
+};
@@ -15,6 +15,26 @@
 #include <string.h>
 #include <string>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <queue>
+// Intrinsics
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	#define CMSX_USE_SIMD
+	#include <immintrin.h>
+	#if defined(_MSC_VER)
+		#define CMSX_TARGET_AVX2
+	#else
+		#include <cpuid.h>
+		#define CMSX_TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#endif
 // FreeImage
 #include "FreeImage.h"
 // CMSXi
@@ -23,28 +43,133 @@
 #include "image.h"
 #include "parser.h"
 
-struct RLEHash
+/// Run of pixels of the RLE compressors (data of the run are stored in the block buffer)
+struct RLESpan
 {
+	i32 start;		///< Index of the first pixel in the block buffer
 	i32 length;
-	u32 color;
-	std::vector<u32> data;
+	u8 color;
+	bool bTrans;
+};
+
+/**
+ * Linear allocator for the scratch data of a block
+ * All allocations are released at once by Reset. Only used for POD types (no constructor/destructor is called).
+ */
+class ScratchArena
+{
+protected:
+	std::vector<u8*> Pages;
+	size_t PageSize;
+	size_t Used;
+
+public:
+	ScratchArena(size_t size = 64 * 1024) : PageSize(size), Used(0) { Pages.push_back(new u8[PageSize]); }
+	~ScratchArena() { for (u32 i = 0; i < Pages.size(); i++) delete[] Pages[i]; }
+
+	/// Allocate an array of the given type (content is not initialized)
+	template<typename T> T* Alloc(size_t num)
+	{
+		size_t bytes = num * sizeof(T);
+		size_t offset = (Used + alignof(T) - 1) & ~(alignof(T) - 1);
+		if (offset + bytes > PageSize)
+		{
+			PageSize = std::max(PageSize * 2, bytes);
+			Pages.push_back(new u8[PageSize]);
+			offset = 0;
+		}
+		Used = offset + bytes;
+		return (T*)(Pages.back() + offset);
+	}
+
+	/// Release all allocations (the largest page is kept for the next block)
+	void Reset()
+	{
+		for (u32 i = 0; i + 1 < Pages.size(); i++)
+			delete[] Pages[i];
+		Pages.erase(Pages.begin(), Pages.end() - 1);
+		Used = 0;
+	}
 
-	RLEHash() : length(0), color(0){}
+private:
+	ScratchArena(const ScratchArena&);
+	ScratchArena& operator=(const ScratchArena&);
 };
 
+//-----------------------------------------------------------------------------
+// BIT SCAN
+//-----------------------------------------------------------------------------
+
+/// Get the index of the lowest bit set (mask can't be 0)
+inline u32 GetLowestBit(u64 mask)
+{
+#if defined(_MSC_VER)
+	unsigned long idx;
+	if (_BitScanForward(&idx, (u32)mask))
+		return idx;
+	_BitScanForward(&idx, (u32)(mask >> 32));
+	return idx + 32;
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+/// Get the index of the highest bit set (mask can't be 0)
+inline u32 GetHighestBit(u64 mask)
+{
+#if defined(_MSC_VER)
+	unsigned long idx;
+	if (_BitScanReverse(&idx, (u32)(mask >> 32)))
+		return idx + 32;
+	_BitScanReverse(&idx, (u32)mask);
+	return idx;
+#else
+	return 63 - __builtin_clzll(mask);
+#endif
+}
+
+/// Pack 8 pixels into a byte (bit is set for non-zero values; first pixel use the higher bit)
+inline u8 PackPixels8(const u8* values)
+{
+#if defined(CMSX_USE_SIMD)
+	__m128i v = _mm_loadl_epi64((const __m128i*)values);
+	v = _mm_shufflelo_epi16(v, 0x1B); // Reverse the 4 words...
+	v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)); // ...and the 2 bytes of each word
+	return (u8)~_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+#else
+	u64 v;
+	memcpy(&v, values, 8);
+	v = ((v & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | v; // Move non-zero flag to the higher bit of each byte...
+	v = (v >> 7) & 0x0101010101010101ULL; // ...then down to the lower bit
+	return (u8)((v * 0x8040201008040201ULL) >> 56);
+#endif
+}
+
+/// Get the number of bits set
+inline i32 GetBitCount(u64 mask)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	return (i32)__popcnt64(mask);
+#elif defined(_MSC_VER)
+	return (i32)(__popcnt((u32)mask) + __popcnt((u32)(mask >> 32)));
+#else
+	return __builtin_popcountll(mask);
+#endif
+}
+
 //-----------------------------------------------------------------------------
 // MSX interface
 //-----------------------------------------------------------------------------
 
 /***/
-u8 GetNearestColorIndex(u32 color, u32* pal, i32 count)
+u8 GetNearestColorIndex(u32 color, const u32* pal, i32 count)
 {
 	u8 bestIndex = 0;
 	i32 bestWeight = 256 * 4;
 
 	RGB24 c = RGB24(color);
 
-	for (u8 i = 1; i <= count + 1; i++)
+	for (u8 i = 1; (i <= count + 1) && (i < 16); i++)
 	{
 		RGB24 p = RGB24(pal[i]);
 
@@ -59,6 +184,290 @@ u8 GetNearestColorIndex(u32 color, u32* pal, i32 count)
 	return bestIndex;
 }
 
+//-----------------------------------------------------------------------------
+// NEAREST COLOR SEARCH
+//-----------------------------------------------------------------------------
+
+/** Set the palette entries to search in
+	Entry 0 (transparent) and entries after count+1 are disabled to give the same result than GetNearestColorIndex */
+void NearestColorPalette::Set(const u32* pal, i32 count)
+{
+	for (i32 i = 0; i < 16; i++)
+	{
+		if ((pal != NULL) && (i >= 1) && (i <= count + 1))
+		{
+			RGB24 p = RGB24(pal[i]);
+			R[i] = p.R;
+			G[i] = p.G;
+			B[i] = p.B;
+		}
+		else
+			R[i] = G[i] = B[i] = DISABLED;
+	}
+}
+
+/// Scalar kernel (first lowest weight wins like in GetNearestColorIndex)
+u8 SearchNearestColorScalar(u32 color, const NearestColorPalette* pal)
+{
+	u8 bestIndex = 0;
+	i32 bestWeight = 256 * 4;
+
+	RGB24 c = RGB24(color);
+
+	for (u8 i = 1; i < 16; i++)
+	{
+		i32 weight = abs(pal->R[i] - c.R) + abs(pal->G[i] - c.G) + abs(pal->B[i] - c.B);
+		if (weight < bestWeight)
+		{
+			bestWeight = weight;
+			bestIndex = i;
+		}
+	}
+
+	return bestIndex;
+}
+
+/***/
+void SearchNearestColorRowScalar(const u32* colors, i32 num, const NearestColorPalette* pal, u8* indices)
+{
+	for (i32 i = 0; i < num; i++)
+		indices[i] = SearchNearestColorScalar(colors[i], pal);
+}
+
+#if defined(CMSX_USE_SIMD)
+
+/// Absolute difference of signed 16-bits values
+inline __m128i AbsDiff16(__m128i a, __m128i b)
+{
+	return _mm_sub_epi16(_mm_max_epi16(a, b), _mm_min_epi16(a, b));
+}
+
+/** SSE2 kernel core: weight of the 16 entries are computed in 2 registers
+	The lowest weight is broadcasted and compared to all entries, then the first matching lane give the index */
+inline u8 SearchNearestColorSSE2Core(u32 color, const __m128i* palR, const __m128i* palG, const __m128i* palB)
+{
+	__m128i r = _mm_set1_epi16((i16)((color >> 16) & 0xFF));
+	__m128i g = _mm_set1_epi16((i16)((color >> 8) & 0xFF));
+	__m128i b = _mm_set1_epi16((i16)(color & 0xFF));
+
+	__m128i w0 = _mm_add_epi16(_mm_add_epi16(AbsDiff16(palR[0], r), AbsDiff16(palG[0], g)), AbsDiff16(palB[0], b));
+	__m128i w1 = _mm_add_epi16(_mm_add_epi16(AbsDiff16(palR[1], r), AbsDiff16(palG[1], g)), AbsDiff16(palB[1], b));
+
+	__m128i m = _mm_min_epi16(w0, w1);
+	m = _mm_min_epi16(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm_min_epi16(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+	m = _mm_min_epi16(m, _mm_srli_epi32(m, 16));
+	i32 bestWeight = _mm_cvtsi128_si32(m) & 0xFFFF;
+	if (bestWeight >= 256 * 4)
+		return 0;
+
+	__m128i best = _mm_set1_epi16((i16)bestWeight);
+	u32 mask = _mm_movemask_epi8(_mm_cmpeq_epi16(w0, best)) | (_mm_movemask_epi8(_mm_cmpeq_epi16(w1, best)) << 16);
+	return (u8)(GetLowestBit(mask) >> 1);
+}
+
+/***/
+u8 SearchNearestColorSSE2(u32 color, const NearestColorPalette* pal)
+{
+	__m128i palR[2] = { _mm_loadu_si128((const __m128i*)&pal->R[0]), _mm_loadu_si128((const __m128i*)&pal->R[8]) };
+	__m128i palG[2] = { _mm_loadu_si128((const __m128i*)&pal->G[0]), _mm_loadu_si128((const __m128i*)&pal->G[8]) };
+	__m128i palB[2] = { _mm_loadu_si128((const __m128i*)&pal->B[0]), _mm_loadu_si128((const __m128i*)&pal->B[8]) };
+	return SearchNearestColorSSE2Core(color, palR, palG, palB);
+}
+
+/***/
+void SearchNearestColorRowSSE2(const u32* colors, i32 num, const NearestColorPalette* pal, u8* indices)
+{
+	__m128i palR[2] = { _mm_loadu_si128((const __m128i*)&pal->R[0]), _mm_loadu_si128((const __m128i*)&pal->R[8]) };
+	__m128i palG[2] = { _mm_loadu_si128((const __m128i*)&pal->G[0]), _mm_loadu_si128((const __m128i*)&pal->G[8]) };
+	__m128i palB[2] = { _mm_loadu_si128((const __m128i*)&pal->B[0]), _mm_loadu_si128((const __m128i*)&pal->B[8]) };
+	for (i32 i = 0; i < num; i++)
+		indices[i] = SearchNearestColorSSE2Core(colors[i], palR, palG, palB);
+}
+
+/** AVX2 kernel core: weight of the 16 entries are computed in 1 register
+	Each half is reduced with minpos that already return the first lane with the lowest value */
+CMSX_TARGET_AVX2 inline u8 SearchNearestColorAVX2Core(u32 color, __m256i palR, __m256i palG, __m256i palB)
+{
+	__m256i r = _mm256_set1_epi16((i16)((color >> 16) & 0xFF));
+	__m256i g = _mm256_set1_epi16((i16)((color >> 8) & 0xFF));
+	__m256i b = _mm256_set1_epi16((i16)(color & 0xFF));
+
+	__m256i w = _mm256_add_epi16(_mm256_add_epi16(_mm256_abs_epi16(_mm256_sub_epi16(palR, r)), _mm256_abs_epi16(_mm256_sub_epi16(palG, g))), _mm256_abs_epi16(_mm256_sub_epi16(palB, b)));
+
+	u32 lo = _mm_cvtsi128_si32(_mm_minpos_epu16(_mm256_castsi256_si128(w)));
+	u32 hi = _mm_cvtsi128_si32(_mm_minpos_epu16(_mm256_extracti128_si256(w, 1)));
+	u32 bestWeight = lo & 0xFFFF;
+	u32 bestIndex = (lo >> 16) & 0x7;
+	if ((hi & 0xFFFF) < bestWeight)
+	{
+		bestWeight = hi & 0xFFFF;
+		bestIndex = 8 + ((hi >> 16) & 0x7);
+	}
+	if (bestWeight >= 256 * 4)
+		return 0;
+
+	return (u8)bestIndex;
+}
+
+/***/
+CMSX_TARGET_AVX2 u8 SearchNearestColorAVX2(u32 color, const NearestColorPalette* pal)
+{
+	return SearchNearestColorAVX2Core(color,
+		_mm256_loadu_si256((const __m256i*)pal->R),
+		_mm256_loadu_si256((const __m256i*)pal->G),
+		_mm256_loadu_si256((const __m256i*)pal->B));
+}
+
+/***/
+CMSX_TARGET_AVX2 void SearchNearestColorRowAVX2(const u32* colors, i32 num, const NearestColorPalette* pal, u8* indices)
+{
+	__m256i palR = _mm256_loadu_si256((const __m256i*)pal->R);
+	__m256i palG = _mm256_loadu_si256((const __m256i*)pal->G);
+	__m256i palB = _mm256_loadu_si256((const __m256i*)pal->B);
+	for (i32 i = 0; i < num; i++)
+		indices[i] = SearchNearestColorAVX2Core(colors[i], palR, palG, palB);
+}
+
+/// Get the SIMD instruction sets supported by the CPU and the OS
+void GetSIMDSupport(bool& bSSE2, bool& bAVX2)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bSSE2 = (info[3] & (1 << 26)) != 0;
+	bool bOSXSave = (info[2] & (1 << 27)) != 0;
+	bool bAVX = (info[2] & (1 << 28)) != 0;
+	bAVX2 = false;
+	if (bOSXSave && bAVX && (maxLeaf >= 7) && ((_xgetbv(0) & 0x6) == 0x6))
+	{
+		__cpuidex(info, 7, 0);
+		bAVX2 = (info[1] & (1 << 5)) != 0;
+	}
+#else
+	__builtin_cpu_init();
+	bSSE2 = __builtin_cpu_supports("sse2") != 0;
+	bAVX2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif // defined(CMSX_USE_SIMD)
+
+/// Nearest color search kernels
+struct NearestColorKernel
+{
+	u8 (*Search)(u32 color, const NearestColorPalette* pal);
+	void (*SearchRow)(const u32* colors, i32 num, const NearestColorPalette* pal, u8* indices);
+
+	/// Select the kernel according to the CPU features
+	NearestColorKernel()
+	{
+		Search = SearchNearestColorScalar;
+		SearchRow = SearchNearestColorRowScalar;
+#if defined(CMSX_USE_SIMD)
+		bool bSSE2, bAVX2;
+		GetSIMDSupport(bSSE2, bAVX2);
+		if (bAVX2)
+		{
+			Search = SearchNearestColorAVX2;
+			SearchRow = SearchNearestColorRowAVX2;
+		}
+		else if (bSSE2)
+		{
+			Search = SearchNearestColorSSE2;
+			SearchRow = SearchNearestColorRowSSE2;
+		}
+#endif
+	}
+};
+
+/// Kernel selected at startup
+static const NearestColorKernel g_NearestColorKernel;
+
+/***/
+u8 SearchNearestColor(u32 color, const NearestColorPalette* pal)
+{
+	return g_NearestColorKernel.Search(color, pal);
+}
+
+/***/
+void SearchNearestColorRow(const u32* colors, i32 num, const NearestColorPalette* pal, u8* indices)
+{
+	g_NearestColorKernel.SearchRow(colors, num, pal, indices);
+}
+
+/** Build the table for the given palette
+	Each cell cover 4x4x4 colors. The distance of a color inside a cell can't differ by more than 9 from
+	the distance of the cell center (in half unit), so the nearest index is stored only when it stay the
+	same for the whole cell. Other cells are marked to be refined by an exact search. */
+void PaletteLUT::Build(const u32* pal, i32 count, bool bTable)
+{
+	nearest.Set(pal, count);
+	table.clear();
+	if (!bTable)
+		return;
+	table.resize(1 << 18);
+
+	i32 palNum = 0;
+	i32 palR[16], palG[16], palB[16];
+	u8 palIdx[16];
+	for (i32 i = 1; i < 16; i++)
+	{
+		if (nearest.R[i] == NearestColorPalette::DISABLED)
+			continue;
+		palR[palNum] = 2 * nearest.R[i];
+		palG[palNum] = 2 * nearest.G[i];
+		palB[palNum] = 2 * nearest.B[i];
+		palIdx[palNum] = (u8)i;
+		palNum++;
+	}
+
+	for (u32 cell = 0; cell < table.size(); cell++)
+	{
+		// Cell center (in half unit)
+		i32 r = (((cell >> 12) & 0x3F) << 3) + 3;
+		i32 g = (((cell >> 6) & 0x3F) << 3) + 3;
+		i32 b = (((cell >> 0) & 0x3F) << 3) + 3;
+
+		i32 dist[16];
+		i32 best = -1;
+		for (i32 k = 0; k < palNum; k++)
+		{
+			dist[k] = abs(palR[k] - r) + abs(palG[k] - g) + abs(palB[k] - b);
+			if ((best < 0) || (dist[k] < dist[best]))
+				best = k;
+		}
+
+		u8 idx = (best < 0) ? 0 : palIdx[best];
+		for (i32 k = 0; k < palNum; k++)
+		{
+			if (k == best)
+				continue;
+			i32 gap = dist[k] - dist[best];
+			if ((gap < 18) || ((gap == 18) && (k < best)))
+			{
+				idx = REFINE;
+				break;
+			}
+		}
+		table[cell] = idx;
+	}
+}
+
+/***/
+void PaletteLUT::GetNearestIndexRow(const u32* colors, i32 num, u8* indices) const
+{
+	if (table.empty())
+	{
+		SearchNearestColorRow(colors, num, &nearest, indices);
+		return;
+	}
+	for (i32 i = 0; i < num; i++)
+		indices[i] = GetNearestIndex(colors[i]);
+}
+
 /***/
 u8 GetGBR8(u32 color, bool bUseTrans, u32 transRGB)
 {
@@ -83,21 +492,114 @@ u8 GetGBR8(u32 color, bool bUseTrans, u32 transRGB)
 }
 
 //-----------------------------------------------------------------------------
-// EXPORT BITMAP
+// DECODE IMAGE
 //-----------------------------------------------------------------------------
 
+/** Build the mask from 32-bits pixels
+	Pixels are compared to the transparency color 4 by 4 (SSE2) and each group give a 4-bits nibble of a word */
+void OpacityMask::Build(const u32* pixels, i32 num, u32 transRGB)
+{
+	words.assign((num + 63) / 64, 0);
+
+	i32 p = 0;
+#if defined(CMSX_USE_SIMD)
+	__m128i rgbMask = _mm_set1_epi32(0x00FFFFFF);
+	__m128i trans = _mm_set1_epi32((i32)transRGB);
+	for (; p + 4 <= num; p += 4)
+	{
+		__m128i rgb = _mm_and_si128(_mm_loadu_si128((const __m128i*)&pixels[p]), rgbMask);
+		u64 opaque = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(rgb, trans))) & 0xF;
+		words[p >> 6] |= opaque << (p & 63);
+	}
+#endif
+	for (; p < num; p++)
+	{
+		if ((0xFFFFFF & pixels[p]) != transRGB)
+			words[p >> 6] |= 1ULL << (p & 63);
+	}
+}
+
+/** Get the first and last opaque pixels of a range (relative to the range start)
+	@return False if all the pixels of the range are transparent */
+bool OpacityMask::GetBounds(i32 start, i32 num, i32& first, i32& last) const
+{
+	if (num <= 0)
+		return false;
+
+	i32 end = start + num - 1;
+	i32 startWord = start >> 6, endWord = end >> 6;
+	u64 startMask = ~0ULL << (start & 63);
+	u64 endMask = ~0ULL >> (63 - (end & 63));
+
+	i32 w;
+	u64 bits = 0;
+	for (w = startWord; w <= endWord; w++)
+	{
+		bits = words[w];
+		if (w == startWord)
+			bits &= startMask;
+		if (w == endWord)
+			bits &= endMask;
+		if (bits)
+			break;
+	}
+	if (w > endWord)
+		return false;
+	first = (w << 6) + GetLowestBit(bits) - start;
+
+	for (w = endWord; w >= startWord; w--)
+	{
+		bits = words[w];
+		if (w == startWord)
+			bits &= startMask;
+		if (w == endWord)
+			bits &= endMask;
+		if (bits)
+			break;
+	}
+	last = (w << 6) + GetHighestBit(bits) - start;
+
+	return true;
+}
+
+/// Convert each pixel to the value written by the bitmap exporter and flag the opaque ones
+void BuildColorPlane(const ExportParameters* param, DecodedImage* img)
+{
+	u32 transRGB = 0x00FFFFFF & param->transColor;
+	i32 num = img->imageX * img->imageY;
+	const u32* pixels = (const u32*)img->bits;
+
+	img->opacity.Build(pixels, num, transRGB);
+	img->plane.resize(num);
+	if ((param->bpc == 2) || (param->bpc == 4))
+		img->paletteLUT.GetNearestIndexRow(pixels, num, img->plane.data());
+
+	for (i32 p = 0; p < num; p++)
+	{
+		u32 rgb = 0xFFFFFF & pixels[p];
+		bool bTrans = (rgb == transRGB);
+		if (param->bpc == 8) // 8-bits GBR color
+			img->plane[p] = GetGBR8(rgb, param->bUseTrans, transRGB);
+		else if ((param->bpc == 4) || (param->bpc == 2)) // Index color palette
+		{
+			if (param->bUseTrans && bTrans)
+				img->plane[p] = 0;
+		}
+		else if (param->bpc == 1) // Black & white
+		{
+			if (param->bUseTrans)
+				img->plane[p] = bTrans ? 0 : 1; // All non-transparent color are 1
+			else
+				img->plane[p] = (rgb != 0) ? 1 : 0; // All non-black color are 1
+		}
+	}
+}
+
 /***/
-bool ExportBitmap(ExportParameters * param, ExporterInterface * exp)
+bool DecodeImage(ExportParameters* param, DecodedImage* img)
 {
 	FIBITMAP *dib, *dib32;
-	i32 i, j, nx, ny, bit, minX, maxX, minY, maxY;
-	RGB24 c24;
-	GRB8 c8;
-	u8 c2, c4, byte = 0;
-	char strData[BUFFER_SIZE];
 	u32 transRGB = 0x00FFFFFF & param->transColor;
-	u32 headAddr = 0, palAddr = 0;
-	std::vector<u16> sprtAddr;
 
 	dib = LoadImage(param->inFile.c_str()); // open and load the file using the default load option
 	if (dib == NULL)
@@ -109,15 +611,24 @@ bool ExportBitmap(ExportParameters * param, ExporterInterface * exp)
 	// Get 32 bits version
 	dib32 = FreeImage_ConvertTo32Bits(dib);
 	FreeImage_Unload(dib); // free the original dib
-	i32 imageX = FreeImage_GetWidth(dib32);
-	i32 imageY = FreeImage_GetHeight(dib32);
-	i32 scanWidth = FreeImage_GetPitch(dib32);
-	i32 bpp = FreeImage_GetBPP(dib32);
-	BYTE* bits = new BYTE[scanWidth * imageY];
-	FreeImage_ConvertToRawBits(bits, dib32, scanWidth, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+	img->imageX = FreeImage_GetWidth(dib32);
+	img->imageY = FreeImage_GetHeight(dib32);
+	img->scanWidth = FreeImage_GetPitch(dib32);
+	delete[] img->bits;
+	img->bits = new BYTE[img->scanWidth * img->imageY];
+	FreeImage_ConvertToRawBits(img->bits, dib32, img->scanWidth, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+
+	// Palette and dithering are only used by the bitmap exporter
+	if (param->mode != MODE_Bitmap)
+	{
+		if ((param->mode == MODE_GM1) || (param->mode == MODE_GM2))
+			img->paletteLUT.Build(PaletteMSX, 16, true);
+		FreeImage_Unload(dib32);
+		return true;
+	}
 
 	// Get custom palette for 16 colors mode
-	u32 customPalette[16];
+	u32* customPalette = img->customPalette;
 	RGBQUAD defaultPal[3] = {
 		{ 0x00, 0x00, 0x00, 0 },
 		{ 0x80, 0x80, 0x80, 0 },
@@ -159,725 +670,1925 @@ bool ExportBitmap(ExportParameters * param, ExporterInterface * exp)
 	else if ((param->bpc == 1) && (param->dither != DITHER_None))
 	{
 		FIBITMAP* dib1 = FreeImage_Dither(dib32, (FREE_IMAGE_DITHER)param->dither);
-		FreeImage_ConvertToRawBits(bits, dib1, scanWidth, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+		FreeImage_ConvertToRawBits(img->bits, dib1, img->scanWidth, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
 		FreeImage_Unload(dib1);
 	}
 
-	FreeImage_Unload(dib32);
+	// Prepare nearest color search for index color formats (custom palette change for each image so lookup table is not built)
+	if ((param->bpc == 2) || (param->bpc == 4))
+		img->paletteLUT.Build((param->palType == PALETTE_MSX1) ? PaletteMSX : customPalette, param->palCount, param->palType == PALETTE_MSX1);
 
-	// Handle whole image case
-	if ((param->sizeX == 0) || (param->sizeY == 0))
-	{
-		param->posX = param->posY = 0;
-		param->sizeX = imageX;
-		param->sizeY = imageY;
-		param->numX = param->numY = 1;
-	}
+	// Convert pixels once for all the encoders
+	BuildColorPlane(param, img);
 
-	//-------------------------------------------------------------------------
-	// File header
-	
-	exp->WriteHeader();
+	FreeImage_Unload(dib32);
 
-	//-------------------------------------------------------------------------
-	// Header table
+	return true;
+}
 
-	if (param->bAddHeader)
+//-----------------------------------------------------------------------------
+// RLEP COMPRESSION
+//-----------------------------------------------------------------------------
+
+#define RLEP_MAX_LENGTH	63	///< Maximum length of a RLEp chunk (6-bits field; 0 is the terminator)
+
+/**
+ * Select the RLEp chunks sequence that give the smallest output (dynamic programming)
+ * Chunk header is [type:2|length:6] followed by:
+ *  - Type 0: nothing (Length times 0x00)
+ *  - Type 1: 1 byte repeated Length times
+ *  - Type 2: 2 bytes pattern repeated Length times
+ *  - Type 3: Length bytes of uncompressed data
+ * @param cost		Buffer of num + 1 entries (size of the best encoding from each position to the end)
+ * @param bestType	Buffer of num entries that receive the type of the chunk starting at each position
+ * @param bestLen	Buffer of num entries that receive the length of the chunk starting at each position
+ * @return Size of the compressed data (including the zero terminator)
+ */
+u32 GetRLEpChunks(const u8* data, i32 num, i32* cost, u8* bestType, u8* bestLen)
+{
+	cost[num] = 0;
+	i32 run = 0;  // Number of identical bytes from i
+	i32 pair = 0; // Number of bytes matching a 2 bytes period from i
+	for (i32 i = num - 1; i >= 0; i--)
 	{
-		sprintf_s(strData, BUFFER_SIZE, "%s_header", param->tabName.c_str());
-		exp->WriteTableBegin(TABLE_Header, strData, "Header table");
+		run = ((i + 1 < num) && (data[i + 1] == data[i])) ? run + 1 : 1;
+		pair = ((i + 2 < num) && (data[i + 2] == data[i])) ? pair + 1 : ((i + 1 < num) ? 2 : 1);
 
-		exp->Write2WordsLine((u16)param->sizeX, (u16)param->sizeY, "Sprite size (X Y)");
-		exp->Write2WordsLine((u16)param->numX, (u16)param->numY, "Sprite count (X Y)");
-		exp->Write1ByteLine((u8)param->bpc, "Bits per color");
-		exp->Write1ByteLine((u8)param->comp, "Compressor");
-		exp->Write1ByteLine(param->bSkipEmpty ? 1 : 0, "Skip empty");
+		// Uncompressed data
+		i32 best = 2 + cost[i + 1];
+		u8 type = 3, len = 1;
+		for (i32 k = 2; (k <= RLEP_MAX_LENGTH) && (i + k <= num); k++)
+		{
+			if (1 + k + cost[i + k] < best)
+			{
+				best = 1 + k + cost[i + k];
+				len = (u8)k;
+			}
+		}
+		// Repeated byte (zero is encoded without data)
+		// A single zero fits in a 1 byte chunk (a literal would cost 2 bytes)
+		i32 head = (data[i] == 0) ? 1 : 2;
+		for (i32 k = (data[i] == 0) ? 1 : 2; k <= std::min(run, RLEP_MAX_LENGTH); k++)
+		{
+			if (head + cost[i + k] < best)
+			{
+				best = head + cost[i + k];
+				type = (data[i] == 0) ? 0 : 1;
+				len = (u8)k;
+			}
+		}
+		// Repeated 2 bytes pattern
+		for (i32 k = 2; k <= std::min(pair / 2, RLEP_MAX_LENGTH); k++)
+		{
+			if (3 + cost[i + (k * 2)] < best)
+			{
+				best = 3 + cost[i + (k * 2)];
+				type = 2;
+				len = (u8)k;
+			}
+		}
+		cost[i] = best;
+		bestType[i] = type;
+		bestLen[i] = len;
+	}
+	return cost[0] + 1;
+}
 
-		exp->WriteTableEnd("");
+/// Write the RLEp chunks selected by GetRLEpChunks
+void WriteRLEpChunks(ExporterInterface* exp, const u8* data, i32 num, const u8* bestType, const u8* bestLen)
+{
+	bool bComments = exp->HasComments();
+	u32 chunk = 0;
+	for (i32 i = 0; i < num; )
+	{
+		u8 type = bestType[i];
+		u8 len = bestLen[i];
+		if (bComments)
+			exp->WriteCommentLine(CMSX::Format("Chunk[%i]", chunk));
+		chunk++;
+		exp->Write1ByteLine((type << 6) | len, bComments ? CMSX::Format("Type=%i, Length=%i", type, len) : "");
+		i32 dataLen = (type == 0) ? 0 : (type == 1) ? 1 : (type == 2) ? 2 : len; // Literal data are written directly from the source
+		for (i32 j = i; j < i + dataLen; j++)
+		{
+			exp->WriteLineBegin();
+			exp->Write8BitsData(data[j]);
+			exp->WriteLineEnd();
+		}
+		i += (type == 2) ? len * 2 : len;
 	}
+	if (bComments)
+		exp->WriteCommentLine("Zero terminator");
+	exp->Write1ByteLine(0x00, "");
+}
 
-	//-------------------------------------------------------------------------
-	// Sprite table
+/// Export data using RLEp compression
+void ExportRLEp(ExportParameters* param, ExporterInterface* exp, const std::vector<u8>& data)
+{
+	i32 num = (i32)data.size();
+	std::vector<i32> cost(num + 1);
+	std::vector<u8> bestType(num + 1);
+	std::vector<u8> bestLen(num + 1);
+	GetRLEpChunks(data.data(), num, cost.data(), bestType.data(), bestLen.data());
+	WriteRLEpChunks(exp, data.data(), num, bestType.data(), bestLen.data());
+}
 
-	sprtAddr.resize(param->numX * param->numY);
-	exp->WriteTableBegin(TABLE_U8, param->tabName, "Data table");
+//-----------------------------------------------------------------------------
+// BITMAP SIZE ESTIMATION
+//-----------------------------------------------------------------------------
 
-	//-------------------------------------------------------------------------
-	// Font header
+/// Align crop horizontal bounds to the bytes boundaries of the given color format
+void AlignCropX(i32 bpc, i32& minX, i32& maxX)
+{
+	if (bpc == 1) // 1-bit black & white
+	{
+		minX &= 0xF8;	 // Round down 8
+		maxX |= 0x07;	 // Round up 8
+	}
+	else if (bpc == 2) // 2-bits index color palette
+	{
+		minX &= 0xFC;	 // Round down 4
+		maxX |= 0x03;	 // Round up 4
+	}
+	else if (bpc == 4) // 4-bits index color palette
+	{
+		minX &= 0xFE;	 // Round down 2
+		maxX |= 0x01;	 // Round up 2
+	}
+}
 
-	if (param->bAddFont)
+/** Get the number of bytes ExportBitmap write for a line of pixels in [minX, maxX]
+	@param offset Index of the first pixel of the line in the image (1-bit format pack pixels according to there absolute position) */
+u32 GetLineBytes(const ExportParameters* param, i32 minX, i32 maxX, i32 offset)
+{
+	i32 lastX = (maxX < param->sizeX - 1) ? maxX : param->sizeX - 1;
+	if (minX > lastX)
+		return 0;
+
+	i32 ppb = 8 / param->bpc; // pixels per byte
+	if (param->bpc != 1)
+		offset = 0;
+
+	// One byte each time the last pixel of a byte is reached, plus the final partial byte (if maxX is reached)
+	u32 bytes = ((offset + lastX + 1) / ppb) - ((offset + minX) / ppb);
+	if ((lastX == maxX) && (((offset + maxX) % ppb) != ppb - 1))
+		bytes++;
+	return bytes;
+}
+
+/** Pack the pixels [minX, maxX] of a block line into bytes of the given color format
+	@param line		Color plane of the block line
+	@param lastX	Last pixel of the block line (pixels after are never packed)
+	@param offset	Index of the first pixel of the line in the image (1-bit format pack pixels according to there absolute position)
+	@param output	Function called for each byte */
+template<i32 BPC, typename Output> void PackBitmapLine(const u8* line, i32 minX, i32 maxX, i32 lastX, i32 offset, Output output)
+{
+	i32 endX = std::min(maxX, lastX);
+	if (BPC == 8) // 8-bits GBR color
 	{
-		exp->WriteCommentLine("Font header data");
-		exp->Write1ByteLine((u8)((8 << 4) + (param->sizeY & 0x0F)), "Data size [x|y]");
-		exp->Write1ByteLine((u8)(((param->fontX & 0x0F) << 4) + (param->fontY & 0x0F)), "Font size [x|y]");
-		sprintf_s(strData, BUFFER_SIZE, "First character ASCII code (%c)", param->fontFirst);
-		exp->Write1ByteLine((u8)param->fontFirst, strData);
-		sprintf_s(strData, BUFFER_SIZE, "Last character ASCII code (%c)", param->fontLast);
-		exp->Write1ByteLine((u8)param->fontLast, strData);
+		for (i32 i = minX; i <= endX; i++)
+			output(line[i]);
+		return;
 	}
 
-	// Parse source image
-	for(ny = 0; ny < param->numY; ny++)
+	const i32 ppb = 8 / BPC; // pixels per byte
+	const u8 mask = (1 << BPC) - 1;
+	u8 byte = 0;
+	for (i32 i = minX; i <= endX; i++)
 	{
-		for (nx = 0; nx < param->numX; nx++)
+		i32 pos = ((BPC == 1) ? (offset + i) : i) & (ppb - 1);
+		if ((BPC == 1) && (pos == 0) && (i + 7 <= endX)) // Whole byte
 		{
-			sprtAddr[nx + (ny * param->numX)] = (u16)exp->GetTotalBytes();
-
-			// Print sprite header
-			exp->WriteSpriteHeader(nx + (ny * param->numX));
-
-			//-----------------------------------------------------------------
-			//
-			// RLE compression
-			//
-			//-----------------------------------------------------------------
-			if (param->comp & COMPRESS_RLE_Mask)
+			output(PackPixels8(line + i));
+			i += 7;
+			continue;
+		}
+		byte |= (line[i] & mask) << ((ppb - 1 - pos) * BPC); // First pixel use higher bits
+		if ((pos == ppb - 1) || (i == maxX))
+		{
+			output(byte);
+			byte = 0;
+		}
+	}
+}
+
+/** Pack all the lines of a block into a buffer allocated from the arena (same bytes than the uncompressed export)
+	@return Number of bytes of the block */
+template<i32 BPC> i32 PackBitmapBlock(const ExportParameters* param, const DecodedImage* img, i32 nx, i32 ny, ScratchArena* arena, u8** data)
+{
+	i32 imageX = img->imageX;
+	i32 blockOffset = param->posX + (nx * (param->sizeX + param->gapX)) + ((param->posY + (ny * (param->sizeY + param->gapY))) * imageX);
+	u8* buffer = arena->Alloc<u8>(param->sizeX * param->sizeY); // A byte can't contain less than one pixel
+	i32 num = 0;
+	for (i32 j = 0; j < param->sizeY; j++)
+	{
+		i32 line = blockOffset + (j * imageX);
+		PackBitmapLine<BPC>(img->plane.data() + line, 0, param->sizeX - 1, param->sizeX - 1, line, [&](u8 byte) { buffer[num++] = byte; });
+	}
+	*data = buffer;
+	return num;
+}
+
+/// Get the RLEp compressed size of a block
+template<i32 BPC> u32 GetBlockRLEpSize(const ExportParameters* param, const DecodedImage* img, i32 nx, i32 ny, ScratchArena* arena)
+{
+	u8* data;
+	i32 num = PackBitmapBlock<BPC>(param, img, nx, ny, arena, &data);
+	i32* cost = arena->Alloc<i32>(num + 1);
+	u8* bestType = arena->Alloc<u8>(num + 1);
+	u8* bestLen = arena->Alloc<u8>(num + 1);
+	return GetRLEpChunks(data, num, cost, bestType, bestLen);
+}
+
+/// Compressors that can be selected for each block in adaptive mode
+static const CMSXi_Compressor AdaptiveCompressors[] =
+{
+	COMPRESS_None,
+	COMPRESS_Crop16,
+	COMPRESS_CropLine16,
+	COMPRESS_Crop32,
+	COMPRESS_CropLine32,
+	COMPRESS_Crop256,
+	COMPRESS_CropLine256,
+	COMPRESS_RLE0,
+	COMPRESS_RLE4,
+	COMPRESS_RLE8,
+	COMPRESS_RLEp
+};
+
+/// Check if a compressor can be selected for a block in adaptive mode
+bool IsAdaptiveCompatible(CMSXi_Compressor comp, const ExportParameters& param)
+{
+	if (!IsCompressorCompatible(comp, param))
+		return false;
+	if (!param.bUseTrans && ((comp & COMPRESS_Crop_Mask) || (comp == COMPRESS_RLE0)))
+		return false;
+	if (((param.bpc == 1) || (param.bpc == 2)) && (comp & COMPRESS_RLE_Mask) && (comp != COMPRESS_RLEp))
+		return false;
+	return true;
+}
+
+/** Compute in a single pass the data size of a block for each of the given compressors
+	@return False if the block contains only transparent pixels */
+bool GetBlockSizes(const ExportParameters* param, const DecodedImage* img, i32 nx, i32 ny, const CMSXi_Compressor* compTable, i32 compCount, u32* sizes, ScratchArena* arena)
+{
+	i32 imageX = img->imageX;
+	const u8* plane = img->plane.data();
+	const OpacityMask& opacity = img->opacity;
+	i32* lineMinX = arena->Alloc<i32>(param->sizeY);
+	i32* lineMaxX = arena->Alloc<i32>(param->sizeY);
+	i32* lineOffset = arena->Alloc<i32>(param->sizeY);
+
+	// Pixels only need to be visited for RLE compressors (RLEp works on the packed bytes)
+	bool bRLE = false;
+	for (i32 c = 0; c < compCount; c++)
+		if ((compTable[c] & COMPRESS_RLE_Mask) && (compTable[c] != COMPRESS_RLEp))
+			bRLE = true;
+
+	//-------------------------------------------------------------------------
+	// Analyze block (single pass over the pixels)
+
+	i32 blockMinX = param->sizeX, blockMaxX = 0, blockMinY = param->sizeY, blockMaxY = 0;
+	bool bEmpty = true;
+
+	u8 lastValue = 0;
+	bool bLastTrans = false;
+	i32 len0 = 0, len4 = 0, len8 = 0;	// length of the current RLE0/RLE4/RLE8 entry
+	u32 entries0 = 0, entries4 = 0, entries8 = 0;
+	u32 data0 = 0;						// RLE0 bytes of non-transparent data
+
+	for (i32 j = 0; j < param->sizeY; j++)
+	{
+		lineOffset[j] = param->posX + (nx * (param->sizeX + param->gapX)) + ((param->posY + j + (ny * (param->sizeY + param->gapY))) * imageX);
+		lineMinX[j] = param->sizeX;
+		lineMaxX[j] = 0;
+
+		// Crop bounds
+		if (opacity.GetBounds(lineOffset[j], param->sizeX, lineMinX[j], lineMaxX[j]))
+		{
+			if (lineMinX[j] < blockMinX)
+				blockMinX = lineMinX[j];
+			if (lineMaxX[j] > blockMaxX)
+				blockMaxX = lineMaxX[j];
+			if (j < blockMinY)
+				blockMinY = j;
+			blockMaxY = j;
+			bEmpty = false;
+		}
+
+		if (!bRLE)
+			continue;
+		for (i32 i = 0; i < param->sizeX; i++)
+		{
+			u8 value = plane[lineOffset[j] + i];
+			bool bTrans = !opacity.IsOpaque(lineOffset[j] + i);
+			bool bFirst = (i == 0) && (j == 0);
+
+			// RLE0 entries (transparent and non-transparent spans)
+			if (!bFirst && (bTrans == bLastTrans) && (len0 < 0x7F))
+				len0++;
+			else
+			{
+				if (!bFirst && !bLastTrans)
+					data0 += (param->bpc == 4) ? (len0 + 1) / 2 : len0;
+				entries0++;
+				len0 = 1;
+			}
+
+			// RLE4 & RLE8 entries (same color spans)
+			if (!bFirst && (value == lastValue) && (len4 < 0x0F))
+				len4++;
+			else
+			{
+				entries4++;
+				len4 = 1;
+			}
+			if (!bFirst && (value == lastValue) && (len8 < 0xFF))
+				len8++;
+			else
+			{
+				entries8++;
+				len8 = 1;
+			}
+
+			lastValue = value;
+			bLastTrans = bTrans;
+		}
+	}
+	if ((len0 > 0) && !bLastTrans)
+		data0 += (param->bpc == 4) ? (len0 + 1) / 2 : len0;
+	if ((param->bpc != 4) && (param->bpc != 8))
+		data0 = 0;
+
+	//-------------------------------------------------------------------------
+	// Compute each compressor size
+
+	for (i32 c = 0; c < compCount; c++)
+	{
+		CMSXi_Compressor comp = compTable[c];
+		u32 bytes = 0;
+
+		if (comp == COMPRESS_RLEp)
+		{
+			if (param->bUseTrans && bEmpty && param->bSkipEmpty)
+				sizes[c] = 0;
+			else
 			{
-				i32 maxLength;
-				switch (param->comp)
+				switch (param->bpc)
 				{
-				case COMPRESS_RLE0: maxLength = 0x7F; break;
-				case COMPRESS_RLE4: maxLength = 0x0F; break;
-				default:            maxLength = 0xFF; // COMPRESS_RLE8
+				case 1:  sizes[c] = GetBlockRLEpSize<1>(param, img, nx, ny, arena); break;
+				case 2:  sizes[c] = GetBlockRLEpSize<2>(param, img, nx, ny, arena); break;
+				case 4:  sizes[c] = GetBlockRLEpSize<4>(param, img, nx, ny, arena); break;
+				default: sizes[c] = GetBlockRLEpSize<8>(param, img, nx, ny, arena); break;
 				}
+			}
+			continue;
+		}
+		if (comp & COMPRESS_RLE_Mask)
+		{
+			if (comp == COMPRESS_RLE0)
+				bytes = entries0 + data0;
+			else if ((comp == COMPRESS_RLE4) && (param->bpc == 4))
+				bytes = entries4;
+			else if ((comp == COMPRESS_RLE8) && ((param->bpc == 4) || (param->bpc == 8)))
+				bytes = 2 * entries8;
+			sizes[c] = bytes;
+			continue;
+		}
 
-				// Hash sprite data
-				std::vector<RLEHash> hashTable;
-				for (j = 0; j < param->sizeY; j++)
+		i32 minX = 0, maxX = param->sizeX - 1, minY = 0, maxY = param->sizeY - 1;
+		if (param->bUseTrans)
+		{
+			if (comp & COMPRESS_Crop_Mask)
+			{
+				minX = blockMinX;
+				maxX = blockMaxX;
+				minY = blockMinY;
+				maxY = blockMaxY;
+			}
+			if (bEmpty)
+			{
+				if (param->bSkipEmpty)
 				{
-					for (i = 0; i < param->sizeX; i++)
-					{
-						i32 pixel = param->posX + i + (nx * (param->sizeX + param->gapX)) + ((param->posY + j + (ny * (param->sizeY + param->gapY))) * imageX);
-						u32 rgb = 0xFFFFFF & ((u32*)bits)[pixel];
+					sizes[c] = 0;
+					continue;
+				}
+				else if (comp & COMPRESS_Crop_Mask)
+					minX = maxX = minY = maxY = 0;
+			}
+			if (comp & COMPRESS_Crop_Mask)
+			{
+				AlignCropX(param->bpc, minX, maxX);
+				switch (comp)
+				{
+				case COMPRESS_Crop16:      minX &= 0x0F; maxX &= 0x0F; minY &= 0x0F; maxY &= 0x0F; bytes += 2; break;
+				case COMPRESS_CropLine16:  minY &= 0x0F; maxY &= 0x0F; bytes += 1; break;
+				case COMPRESS_Crop32:      minX &= 0x07; maxX &= 0x1F; minY &= 0x07; maxY &= 0x1F; bytes += 2; break;
+				case COMPRESS_CropLine32:  minY &= 0x07; maxY &= 0x1F; bytes += 1; break;
+				case COMPRESS_Crop256:     bytes += 4; break;
+				case COMPRESS_CropLine256: bytes += 2; break;
+				default: break;
+				}
+			}
+		}
 
-						if (param->comp == COMPRESS_RLE0) // Transparency color Run-length encoding
-						{
-							if ((hashTable.size() != 0) && (rgb == transRGB) && (hashTable.back().color == transRGB) && (hashTable.back().length < maxLength))
-							{
-								hashTable.back().length++;
-							}
-							else if ((hashTable.size() != 0) && (rgb != transRGB) && (hashTable.back().color != transRGB) && (hashTable.back().length < maxLength))
-							{
-								hashTable.back().length++;
-								hashTable.back().data.push_back(rgb);
-							}
-							else
-							{
-								RLEHash hash;
-								hash.color = rgb;
-								hash.length = 1;
-								hash.data.push_back(rgb);
-								hashTable.push_back(hash);
-							}
-						}
-						else if ((param->comp == COMPRESS_RLE4) || (param->comp == COMPRESS_RLE8)) // Full color Run-length encoding
-						{
-							if ((hashTable.size() != 0) && (rgb == hashTable.back().color) && (hashTable.back().length < maxLength))
-							{
-								hashTable.back().length++;
-							}
-							else
-							{
-								RLEHash hash;
-								hash.color = rgb;
-								hash.length = 1;
-								hashTable.push_back(hash);
-							}
-						}
-					}
+		for (i32 j = 0; j < param->sizeY; j++)
+		{
+			if ((j < minY) || (j > maxY))
+				continue;
+			if (comp & COMPRESS_CropLine_Mask)
+			{
+				i32 lineMin = lineMinX[j], lineMax = lineMaxX[j];
+				AlignCropX(param->bpc, lineMin, lineMax);
+				switch (comp)
+				{
+				case COMPRESS_CropLine16:  lineMin &= 0x0F; lineMax &= 0x0F; bytes += 1; break;
+				case COMPRESS_CropLine32:  lineMin &= 0x07; lineMax &= 0x1F; bytes += 1; break;
+				case COMPRESS_CropLine256: bytes += 2; break;
+				default: break;
 				}
+				bytes += GetLineBytes(param, lineMin, lineMax, lineOffset[j]);
+			}
+			else
+				bytes += GetLineBytes(param, minX, maxX, lineOffset[j]);
+		}
+		sizes[c] = bytes;
+	}
+
+	return !bEmpty;
+}
+
+/***/
+bool GetBitmapSizes(ExportParameters* param, const DecodedImage* img, const CMSXi_Compressor* compTable, i32 compCount, u32* sizes)
+{
+	// Handle whole image case
+	if ((param->sizeX == 0) || (param->sizeY == 0))
+	{
+		param->posX = param->posY = 0;
+		param->sizeX = img->imageX;
+		param->sizeY = img->imageY;
+		param->numX = param->numY = 1;
+	}
+
+	// Data outside the blocks (header, font, index and palette tables)
+	u32 commonSize = 0;
+	if (param->bAddHeader)
+		commonSize += 11;
+	if (param->bAddFont)
+		commonSize += 4;
+	if (param->bAddIndex)
+		commonSize += 2 * param->numX * param->numY;
+	if (((param->bpc == 2) || (param->bpc == 4)) && (param->palType == PALETTE_Custom))
+		commonSize += 2 * param->palCount;
+	for (i32 c = 0; c < compCount; c++)
+		sizes[c] = commonSize;
+
+	std::vector<u32> blockSizes(compCount);
+	ScratchArena arena;
+	for (i32 ny = 0; ny < param->numY; ny++)
+	{
+		for (i32 nx = 0; nx < param->numX; nx++)
+		{
+			arena.Reset();
+			GetBlockSizes(param, img, nx, ny, compTable, compCount, blockSizes.data(), &arena);
+			for (i32 c = 0; c < compCount; c++)
+				sizes[c] += blockSizes[c];
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// EXPORT BITMAP
+//-----------------------------------------------------------------------------
+
+/// Block layout of the uncompressed and crop compressors
+enum BitmapBlockKind
+{
+	BLOCK_None,		///< All block lines are written entirely
+	BLOCK_Crop,		///< Only the non-transparent rectangle is written
+	BLOCK_CropLine,	///< Only the non-transparent lines are written (each line is cropped)
+};
+
+/// Block encoder function
+typedef bool (*BitmapBlockEncoder)(const ExportParameters* param, const DecodedImage* img, CMSXi_Compressor comp, i32 nx, i32 ny, ExporterInterface* exp, ScratchArena* arena);
+
+/** Write the pixels [minX, maxX] of a block line
+	@param line		Color plane of the block line
+	@param lastX	Last pixel of the block line (pixels after are never written)
+	@param offset	Index of the first pixel of the line in the image (1-bit format pack pixels according to there absolute position) */
+template<i32 BPC> void WriteBitmapLine(ExporterInterface* exp, const u8* line, i32 minX, i32 maxX, i32 lastX, i32 offset)
+{
+	// Bytes are handed to the exporter by chunks
+	u8 buffer[256];
+	i32 num = 0;
+	auto flush = [&]()
+	{
+		if (BPC == 1)
+			exp->WriteBits(buffer, num);
+		else
+			exp->WriteBytes(buffer, num);
+		num = 0;
+	};
+	PackBitmapLine<BPC>(line, minX, maxX, lastX, offset, [&](u8 byte)
+	{
+		buffer[num++] = byte;
+		if (num == sizeof(buffer))
+			flush();
+	});
+	if (num > 0)
+		flush();
+}
+
+/// Align and clamp block bounds to the crop compressor format then write the block header
+void WriteCropHeader(i32 bpc, CMSXi_Compressor comp, i32& minX, i32& maxX, i32& minY, i32& maxY, ExporterInterface* exp)
+{
+	AlignCropX(bpc, minX, maxX);
+	bool bComments = exp->HasComments();
 
-				// Write hash table
-				for (u32 k = 0; k < hashTable.size(); k++)
+	if (comp == COMPRESS_Crop16)
+	{
+		minX &= 0x0F;	// Clamp to 4-bits (0-15)
+		maxX &= 0x0F;	// Clamp to 4-bits (0-15)
+		minY &= 0x0F;	// Clamp to 4-bits (0-15)
+		maxY &= 0x0F;	// Clamp to 4-bits (0-15)
+		exp->Write2BytesLine(u8((minX << 4) + maxX), u8(((minY) << 4) + maxY), bComments ? "[minX:4|maxX:4] [minY:4|maxY:4]" : "");
+	}
+	else if (comp == COMPRESS_CropLine16)
+	{
+		minY &= 0x0F;	// Clamp to 4-bits (0-15)
+		maxY &= 0x0F;	// Clamp to 4-bits (0-15)
+		exp->Write1ByteLine(u8((minY << 4) + maxY), bComments ? "[minY:4|maxY:4]" : "");
+	}
+	else if (comp == COMPRESS_Crop32)
+	{
+		minX &= 0x07;	// Clamp to 3-bits (0-7)
+		maxX &= 0x1F;	// Clamp to 5-bits (0-31)
+		minY &= 0x07;	// Clamp to 3-bits (0-7)
+		maxY &= 0x1F;	// Clamp to 5-bits (0-31)
+		exp->Write2BytesLine(u8((minX << 5) + maxX), u8(((minY) << 5) + maxY), bComments ? "[minX:3|maxX:5] [minY:3|maxY:5]" : "");
+	}
+	else if (comp == COMPRESS_CropLine32)
+	{
+		minY &= 0x07;	// Clamp to 3-bits (0-7)
+		maxY &= 0x1F;	// Clamp to 5-bits (0-31)
+		exp->Write1ByteLine(u8(((minY) << 5) + maxY), bComments ? "[minY:3|maxY:5]" : "");
+	}
+	else if (comp == COMPRESS_Crop256)
+	{
+		exp->Write4BytesLine(u8(minX), u8(maxX), u8(minY), u8(maxY), bComments ? "[minX] [maxX] [minY] [maxY]" : "");
+	}
+	else if (comp == COMPRESS_CropLine256)
+	{
+		exp->Write2BytesLine(u8(minY), u8(maxY), bComments ? "[minY] [maxY]" : "");
+	}
+}
+
+/// Align and clamp line bounds to the line-crop compressor format then write the line header
+void WriteCropLineHeader(i32 bpc, CMSXi_Compressor comp, i32& minX, i32& maxX, ExporterInterface* exp)
+{
+	AlignCropX(bpc, minX, maxX);
+	bool bComments = exp->HasComments();
+
+	if (comp == COMPRESS_CropLine16)
+	{
+		minX &= 0x0F;	// Clamp to 4-bits (0-15)
+		maxX &= 0x0F;	// Clamp to 4-bits (0-15)
+		exp->Write1ByteLine(u8((minX << 4) + maxX), bComments ? "[minX:4|maxX:4]" : "");
+	}
+	else if (comp == COMPRESS_CropLine32)
+	{
+		minX &= 0x07;	// Clamp to 3-bits (0-7)
+		maxX &= 0x1F;	// Clamp to 5-bits (0-31)
+		exp->Write1ByteLine(u8(((minX) << 5) + maxX), bComments ? "[minX:3|maxX:5]" : "");
+	}
+	else if (comp == COMPRESS_CropLine256)
+	{
+		exp->Write2BytesLine(u8(minX), u8(maxX), bComments ? "[minX] [maxX]" : "");
+	}
+}
+
+/** Export a block with no compression or with a crop compressor
+	@return False if the block is empty and have been skipped */
+template<i32 BPC, i32 KIND, bool TRANS>
+bool ExportBitmapBlockRaw(const ExportParameters* param, const DecodedImage* img, CMSXi_Compressor comp, i32 nx, i32 ny, ExporterInterface* exp, ScratchArena* arena)
+{
+	const u8* plane = img->plane.data();
+	const OpacityMask& opacity = img->opacity;
+	i32 imageX = img->imageX;
+	i32 blockOffset = param->posX + (nx * (param->sizeX + param->gapX)) + ((param->posY + (ny * (param->sizeY + param->gapY))) * imageX);
+
+	i32 minX = 0;
+	i32 maxX = param->sizeX - 1;
+	i32 minY = 0;
+	i32 maxY = param->sizeY - 1;
+
+	if (TRANS)
+	{
+		// Compute bound for crop compression and check for non transparent pixels
+		bool bEmpty = true;
+		if (KIND != BLOCK_None)
+		{
+			minX = param->sizeX;
+			maxX = 0;
+			minY = param->sizeY;
+			maxY = 0;
+		}
+		i32 line = blockOffset;
+		for (i32 j = 0; j < param->sizeY; j++, line += imageX)
+		{
+			i32 first, last;
+			if (opacity.GetBounds(line, param->sizeX, first, last))
+			{
+				bEmpty = false;
+				if (KIND == BLOCK_None)
+					break;
+				if (first < minX)
+					minX = first;
+				if (last > maxX)
+					maxX = last;
+				if (j < minY)
+					minY = j;
+				maxY = j;
+			}
+		}
+
+		// Handle Empty
+		if (bEmpty)
+		{
+			if (param->bSkipEmpty)
+				return false;
+			else if (KIND != BLOCK_None)
+				minX = maxX = minY = maxY = 0;
+		}
+
+		// Sprite header
+		if (KIND != BLOCK_None)
+			WriteCropHeader(BPC, comp, minX, maxX, minY, maxY, exp);
+	}
+
+	// Print sprite content
+	for (i32 j = minY; (j <= maxY) && (j < param->sizeY); j++)
+	{
+		i32 line = blockOffset + (j * imageX);
+
+		// for line-crop, we need to recompute minX&maxX for each line
+		if (KIND == BLOCK_CropLine)
+		{
+			minX = param->sizeX;
+			maxX = 0;
+			opacity.GetBounds(line, param->sizeX, minX, maxX);
+			WriteCropLineHeader(BPC, comp, minX, maxX, exp);
+		}
+
+		// Add sprite data
+		exp->WriteLineBegin();
+		WriteBitmapLine<BPC>(exp, plane + line, minX, maxX, param->sizeX - 1, line);
+		exp->WriteLineEnd();
+	}
+
+	return true;
+}
+
+/** Export a block with a RLE compressor
+	@return Always true (empty blocks are not skipped) */
+template<i32 BPC, CMSXi_Compressor COMP>
+bool ExportBitmapBlockRLE(const ExportParameters* param, const DecodedImage* img, CMSXi_Compressor comp, i32 nx, i32 ny, ExporterInterface* exp, ScratchArena* arena)
+{
+	const u8* plane = img->plane.data();
+	const OpacityMask& opacity = img->opacity;
+	i32 imageX = img->imageX;
+	i32 blockOffset = param->posX + (nx * (param->sizeX + param->gapX)) + ((param->posY + (ny * (param->sizeY + param->gapY))) * imageX);
+	const i32 maxLength = (COMP == COMPRESS_RLE0) ? 0x7F : (COMP == COMPRESS_RLE4) ? 0x0F : 0xFF;
+
+	// Copy block data and split them into runs (a block can't have more runs than pixels)
+	i32 pixelNum = param->sizeX * param->sizeY;
+	u8* blockData = arena->Alloc<u8>(pixelNum);
+	RLESpan* spans = arena->Alloc<RLESpan>(pixelNum);
+	i32 spanNum = 0;
+	i32 k = 0;
+	for (i32 j = 0; j < param->sizeY; j++)
+	{
+		i32 line = blockOffset + (j * imageX);
+		for (i32 i = 0; i < param->sizeX; i++, k++)
+		{
+			u8 value = plane[line + i];
+			bool bTrans = !opacity.IsOpaque(line + i);
+			blockData[k] = value;
+
+			bool bExtend;
+			if (COMP == COMPRESS_RLE0) // Transparency color Run-length encoding
+				bExtend = (spanNum != 0) && (bTrans == spans[spanNum - 1].bTrans) && (spans[spanNum - 1].length < maxLength);
+			else // Full color Run-length encoding
+				bExtend = (spanNum != 0) && (value == spans[spanNum - 1].color) && (spans[spanNum - 1].length < maxLength);
+
+			if (bExtend)
+			{
+				spans[spanNum - 1].length++;
+			}
+			else
+			{
+				RLESpan& span = spans[spanNum++];
+				span.start = k;
+				span.length = 1;
+				span.color = value;
+				span.bTrans = bTrans;
+			}
+		}
+	}
+
+	// Write runs
+	for (k = 0; k < spanNum; k++)
+	{
+		const RLESpan& span = spans[k];
+		exp->WriteLineBegin();
+		if (COMP == COMPRESS_RLE0) // Transparency color Run-length encoding
+		{
+			if (span.bTrans)
+			{
+				exp->Write1ByteData(0x80 + (u8)span.length);
+			}
+			else
+			{
+				const u8* data = blockData + span.start;
+				exp->Write1ByteData((u8)span.length);
+				if (BPC == 4) // 4-bits index color palette
 				{
-					exp->WriteLineBegin();
-					if (param->comp == COMPRESS_RLE0) // Transparency color Run-length encoding
+					u8 byte = 0;
+					for (i32 l = 0; l < span.length; l++)
 					{
-						if (hashTable[k].color == transRGB)
-						{
-							exp->Write1ByteData(0x80 + (u8)hashTable[k].length);
-						}
+						if (l & 0x1)
+							byte |= data[l]; // Second pixel use lower bits
 						else
+							byte |= (data[l] << 4); // First pixel use higher bits
+						if ((l & 0x1) || (l == span.length - 1))
 						{
-							exp->Write1ByteData((u8)hashTable[k].length);
-							if (param->bpc == 4) // 4-bits index color palette
-							{
-								u8 byte;
-								for (u32 l = 0; l < hashTable[k].data.size(); l++)
-								{
-									u32 rgb = hashTable[k].color;
-									u32* pal = (param->palType == PALETTE_MSX1) ? PaletteMSX : customPalette;
-									if (param->bUseTrans)
-										c4 = (rgb == transRGB) ? 0x0 : GetNearestColorIndex(rgb, pal, param->palCount);
-									else
-										c4 = GetNearestColorIndex(rgb, pal, param->palCount);
-									if (l & 0x1)
-										byte |= c4; // Second pixel use lower bits
-									else
-										byte |= (c4 << 4); // First pixel use higher bits
-									if ((l & 0x1) || (l == hashTable[k].data.size() - 1))
-									{
-										exp->Write1ByteData(byte);
-										byte = 0;
-									}
-								}
-							}
-							else if (param->bpc == 8) // 8-bits GBR color
-							{
-								for (u32 l = 0; l < hashTable[k].data.size(); l++)
-								{
-									c8 = GetGBR8(hashTable[k].data[l], param->bUseTrans, transRGB);
-									exp->Write1ByteData(c8);
-								}
-							}
-						}
-					}
-					else if (param->comp == COMPRESS_RLE4) // Full color 4bits Run-length encoding
-					{
-						if (param->bpc == 4) // 4-bits index color palette
-						{
-							u32 rgb = hashTable[k].color;
-							u32* pal = (param->palType == PALETTE_MSX1) ? PaletteMSX : customPalette;
-							if (param->bUseTrans)
-								c4 = (rgb == transRGB) ? 0x0 : GetNearestColorIndex(rgb, pal, param->palCount);
-							else
-								c4 = GetNearestColorIndex(rgb, pal, param->palCount);
-							u8 byte = ((0x0F & hashTable[k].length) << 4) + c4;
 							exp->Write1ByteData(byte);
+							byte = 0;
 						}
 					}
-					else if (param->comp == COMPRESS_RLE8) // Full color 8bits Run-length encoding
-					{
-						if (param->bpc == 4) // 4-bits index color palette
-						{
-							exp->Write1ByteData((u8)hashTable[k].length);
-							u32 rgb = hashTable[k].color;
-							u32* pal = (param->palType == PALETTE_MSX1) ? PaletteMSX : customPalette;
-							if (param->bUseTrans)
-								c4 = (rgb == transRGB) ? 0x0 : GetNearestColorIndex(rgb, pal, param->palCount);
-							else
-								c4 = GetNearestColorIndex(rgb, pal, param->palCount);
-							exp->Write1ByteData(c4);
-						}
-						else if (param->bpc == 8) // 8-bits GBR color
-						{
-							exp->Write1ByteData((u8)hashTable[k].length);
-							c8 = GetGBR8(hashTable[k].color, param->bUseTrans, transRGB);
-							exp->Write1ByteData(c8);
-						}
-					}
-					exp->WriteLineEnd();
+				}
+				else if (BPC == 8) // 8-bits GBR color
+				{
+					exp->WriteBytes(data, span.length);
 				}
 			}
-			//-----------------------------------------------------------------
-			//
-			// Crop & No compression
-			//
-			//-----------------------------------------------------------------
-			else
+		}
+		else if (COMP == COMPRESS_RLE4) // Full color 4bits Run-length encoding
+		{
+			if (BPC == 4) // 4-bits index color palette
+				exp->Write1ByteData(((0x0F & span.length) << 4) + span.color);
+		}
+		else if (COMP == COMPRESS_RLE8) // Full color 8bits Run-length encoding
+		{
+			if ((BPC == 4) || (BPC == 8)) // 4-bits index color palette or 8-bits GBR color
 			{
-				minX = 0;
-				maxX = param->sizeX - 1;
-				minY = 0;
-				maxY = param->sizeY - 1;
+				exp->Write1ByteData((u8)span.length);
+				exp->Write1ByteData(span.color);
+			}
+		}
+		exp->WriteLineEnd();
+	}
 
-				if (param->bUseTrans)
-				{
-					// Compute bound for crop compression and count non transparent pixels
-					i32 count = 0;
-					if (param->comp & COMPRESS_Crop_Mask)
-					{
-						minX = param->sizeX;
-						maxX = 0;
-						minY = param->sizeY;
-						maxY = 0;
-					}
-					for (j = 0; j < param->sizeY; j++)
-					{
-						for (i = 0; i < param->sizeX; i++)
-						{
-							i32 pixel = param->posX + i + (nx * (param->sizeX + param->gapX)) + ((param->posY + j + (ny * (param->sizeY + param->gapY))) * imageX);
-							u32 rgb = 0xFFFFFF & ((u32*)bits)[pixel];
-							if (rgb != transRGB)
-							{
-								if (param->comp & COMPRESS_Crop_Mask)
-								{
-									if (i < minX)
-										minX = i;
-									if (i > maxX)
-										maxX = i;
-									if (j < minY)
-										minY = j;
-									if (j > maxY)
-										maxY = j;
-								}
-								count++;
-							}
-						}
-					}
+	return true;
+}
 
-					// Handle Empty
-					if (count == 0)
-					{
-						if (param->bSkipEmpty)
-						{
-							sprtAddr[nx + (ny * param->numX)] = CMSXi_NO_ENTRY;
-							continue;
-						}
-						else if (param->comp & COMPRESS_Crop_Mask)
-							minX = maxX = minY = maxY = 0;
-					}
+/** Export a block with the RLEp compressor (applied to the uncompressed block bytes)
+	@return False if the block is empty and have been skipped */
+template<i32 BPC>
+bool ExportBitmapBlockRLEp(const ExportParameters* param, const DecodedImage* img, CMSXi_Compressor comp, i32 nx, i32 ny, ExporterInterface* exp, ScratchArena* arena)
+{
+	i32 imageX = img->imageX;
+	i32 blockOffset = param->posX + (nx * (param->sizeX + param->gapX)) + ((param->posY + (ny * (param->sizeY + param->gapY))) * imageX);
 
-					// Sprite header
-					if ((param->comp & COMPRESS_Crop_Mask))
-					{
-						if (param->bpc == 1) // 1-bit black & white
-						{
-							minX &= 0xF8;	 // Round down 8
-							maxX |= 0x07;	 // Round up 8
-						}
-						else if (param->bpc == 2) // 2-bits index color palette
-						{
-							minX &= 0xFC;	 // Round down 4
-							maxX |= 0x03;	 // Round up 4
-						}
-						else if (param->bpc == 4) // 4-bits index color palette
-						{
-							minX &= 0xFE;	 // Round down 2
-							maxX |= 0x01;	 // Round up 2
-						}
+	// Handle Empty
+	if (param->bUseTrans && param->bSkipEmpty)
+	{
+		bool bEmpty = true;
+		for (i32 j = 0; (j < param->sizeY) && bEmpty; j++)
+		{
+			i32 first, last;
+			if (img->opacity.GetBounds(blockOffset + (j * imageX), param->sizeX, first, last))
+				bEmpty = false;
+		}
+		if (bEmpty)
+			return false;
+	}
 
-						if (param->comp == COMPRESS_Crop16)
-						{
-							minX &= 0x0F;	// Clamp to 4-bits (0-15)
-							maxX &= 0x0F;	// Clamp to 4-bits (0-15)
-							minY &= 0x0F;	// Clamp to 4-bits (0-15)
-							maxY &= 0x0F;	// Clamp to 4-bits (0-15)
-							exp->Write2BytesLine(u8((minX << 4) + maxX), u8(((minY) << 4) + maxY), "[minX:4|maxX:4] [minY:4|maxY:4]");
-						}
-						else if (param->comp == COMPRESS_CropLine16)
-						{
-							minY &= 0x0F;	// Clamp to 4-bits (0-15)
-							maxY &= 0x0F;	// Clamp to 4-bits (0-15)
-							exp->Write1ByteLine(u8((minY << 4) + maxY), "[minY:4|maxY:4]");
-						}
-						else if (param->comp == COMPRESS_Crop32)
-						{
-							minX &= 0x07;	// Clamp to 3-bits (0-7)
-							maxX &= 0x1F;	// Clamp to 5-bits (0-31)
-							minY &= 0x07;	// Clamp to 3-bits (0-7)
-							maxY &= 0x1F;	// Clamp to 5-bits (0-31)
-							exp->Write2BytesLine(u8((minX << 5) + maxX), u8(((minY) << 5) + maxY), "[minX:3|maxX:5] [minY:3|maxY:5]");
-						}
-						else if (param->comp == COMPRESS_CropLine32)
-						{
-							minY &= 0x07;	// Clamp to 3-bits (0-7)
-							maxY &= 0x1F;	// Clamp to 5-bits (0-31)
-							exp->Write1ByteLine(u8(((minY) << 5) + maxY), "[minY:3|maxY:5]");
-						}
-						else if (param->comp == COMPRESS_Crop256)
-						{
-							exp->Write4BytesLine(u8(minX), u8(maxX), u8(minY), u8(maxY), "[minX] [maxX] [minY] [maxY]");
-						}
-						else if (param->comp == COMPRESS_CropLine256)
-						{
-							exp->Write2BytesLine(u8(minY), u8(maxY), "[minY] [maxY]");
-						}
-					}
+	u8* data;
+	i32 num = PackBitmapBlock<BPC>(param, img, nx, ny, arena, &data);
+	i32* cost = arena->Alloc<i32>(num + 1);
+	u8* bestType = arena->Alloc<u8>(num + 1);
+	u8* bestLen = arena->Alloc<u8>(num + 1);
+	GetRLEpChunks(data, num, cost, bestType, bestLen);
+	WriteRLEpChunks(exp, data, num, bestType, bestLen);
+
+	return true;
+}
+
+/// Export nothing (compressors not supported for bitmap)
+bool ExportBitmapBlockEmpty(const ExportParameters* param, const DecodedImage* img, CMSXi_Compressor comp, i32 nx, i32 ny, ExporterInterface* exp, ScratchArena* arena)
+{
+	return true;
+}
+
+/// Get the block encoder specialized for the given color format
+template<i32 BPC> BitmapBlockEncoder GetBitmapBlockEncoder(CMSXi_Compressor comp, bool bUseTrans)
+{
+	switch (comp)
+	{
+	case COMPRESS_None:
+		return bUseTrans ? ExportBitmapBlockRaw<BPC, BLOCK_None, true> : ExportBitmapBlockRaw<BPC, BLOCK_None, false>;
+	case COMPRESS_Crop16:
+	case COMPRESS_Crop32:
+	case COMPRESS_Crop256:
+		return bUseTrans ? ExportBitmapBlockRaw<BPC, BLOCK_Crop, true> : ExportBitmapBlockRaw<BPC, BLOCK_None, false>;
+	case COMPRESS_CropLine16:
+	case COMPRESS_CropLine32:
+	case COMPRESS_CropLine256:
+		return bUseTrans ? ExportBitmapBlockRaw<BPC, BLOCK_CropLine, true> : ExportBitmapBlockRaw<BPC, BLOCK_CropLine, false>;
+	case COMPRESS_RLE0:
+		return ExportBitmapBlockRLE<BPC, COMPRESS_RLE0>;
+	case COMPRESS_RLE4:
+		return ExportBitmapBlockRLE<BPC, COMPRESS_RLE4>;
+	case COMPRESS_RLE8:
+		return ExportBitmapBlockRLE<BPC, COMPRESS_RLE8>;
+	case COMPRESS_RLEp:
+		return ExportBitmapBlockRLEp<BPC>;
+	default:
+		return ExportBitmapBlockEmpty;
+	}
+}
+
+/// Get the block encoder specialized for the given color format, compressor and transparency (done once per export)
+BitmapBlockEncoder GetBitmapBlockEncoder(i32 bpc, CMSXi_Compressor comp, bool bUseTrans)
+{
+	switch (bpc)
+	{
+	case 1:  return GetBitmapBlockEncoder<1>(comp, bUseTrans);
+	case 2:  return GetBitmapBlockEncoder<2>(comp, bUseTrans);
+	case 4:  return GetBitmapBlockEncoder<4>(comp, bUseTrans);
+	default: return GetBitmapBlockEncoder<8>(comp, bUseTrans);
+	}
+}
+
+/** Export a block of the bitmap
+	@param encoder	Block encoder of the export compressor (NULL in adaptive mode)
+	@param arena	Allocator for the scratch data of the block (reset by the caller between blocks)
+	@return False if the block is empty and have been skipped */
+bool ExportBitmapBlock(const ExportParameters* param, const DecodedImage* img, const std::vector<CMSXi_Compressor>& adaptiveComp, BitmapBlockEncoder encoder, i32 nx, i32 ny, ExporterInterface* exp, ScratchArena* arena)
+{
+	// Select the smallest compressor for this block and write its ID as tag
+	CMSXi_Compressor comp = param->comp;
+	if (param->comp == COMPRESS_Adaptive)
+	{
+		u32 adaptiveSize[numberof(AdaptiveCompressors)];
+		bool bEmpty = !GetBlockSizes(param, img, nx, ny, adaptiveComp.data(), (i32)adaptiveComp.size(), adaptiveSize, arena);
+		if (bEmpty && param->bUseTrans && param->bSkipEmpty)
+			return false;
+		comp = adaptiveComp[0];
+		u32 bestSize = adaptiveSize[0];
+		for (u32 c = 1; c < adaptiveComp.size(); c++)
+		{
+			if (adaptiveSize[c] < bestSize)
+			{
+				bestSize = adaptiveSize[c];
+				comp = adaptiveComp[c];
+			}
+		}
+		exp->Write1ByteLine((u8)comp, exp->HasComments() ? CMSX::Format("Compressor: %s", GetCompressorName(comp, true)) : "");
+		encoder = GetBitmapBlockEncoder(param->bpc, comp, param->bUseTrans);
+	}
+
+	return encoder(param, img, comp, nx, ny, exp, arena);
+}
+
+/***/
+bool ExportBitmap(ExportParameters* param, const DecodedImage* img, ExporterInterface* exp)
+{
+	char strData[BUFFER_SIZE];
+	std::vector<u16> sprtAddr;
+
+	i32 imageX = img->imageX;
+	i32 imageY = img->imageY;
+	const u32* customPalette = img->customPalette;
+
+	// Handle whole image case
+	if ((param->sizeX == 0) || (param->sizeY == 0))
+	{
+		param->posX = param->posY = 0;
+		param->sizeX = imageX;
+		param->sizeY = imageY;
+		param->numX = param->numY = 1;
+	}
+
+	//-------------------------------------------------------------------------
+	// File header
+	
+	exp->WriteHeader();
+
+	//-------------------------------------------------------------------------
+	// Header table
+
+	if (param->bAddHeader)
+	{
+		sprintf_s(strData, BUFFER_SIZE, "%s_header", param->tabName.c_str());
+		exp->WriteTableBegin(TABLE_Header, strData, "Header table");
+
+		exp->Write2WordsLine((u16)param->sizeX, (u16)param->sizeY, "Sprite size (X Y)");
+		exp->Write2WordsLine((u16)param->numX, (u16)param->numY, "Sprite count (X Y)");
+		exp->Write1ByteLine((u8)param->bpc, "Bits per color");
+		exp->Write1ByteLine((u8)param->comp, "Compressor");
+		exp->Write1ByteLine(param->bSkipEmpty ? 1 : 0, "Skip empty");
+
+		exp->WriteTableEnd("");
+	}
+
+	//-------------------------------------------------------------------------
+	// Sprite table
+
+	sprtAddr.resize(param->numX * param->numY);
+	exp->WriteTableBegin(TABLE_U8, param->tabName, "Data table");
+
+	//-------------------------------------------------------------------------
+	// Font header
+
+	if (param->bAddFont)
+	{
+		exp->WriteCommentLine("Font header data");
+		exp->Write1ByteLine((u8)((8 << 4) + (param->sizeY & 0x0F)), "Data size [x|y]");
+		exp->Write1ByteLine((u8)(((param->fontX & 0x0F) << 4) + (param->fontY & 0x0F)), "Font size [x|y]");
+		exp->Write1ByteLine((u8)param->fontFirst, exp->HasComments() ? CMSX::Format("First character ASCII code (%c)", param->fontFirst) : "");
+		exp->Write1ByteLine((u8)param->fontLast, exp->HasComments() ? CMSX::Format("Last character ASCII code (%c)", param->fontLast) : "");
+	}
+
+	// Get the compressors usable in adaptive mode
+	std::vector<CMSXi_Compressor> adaptiveComp;
+	if (param->comp == COMPRESS_Adaptive)
+	{
+		for (i32 c = 0; c < numberof(AdaptiveCompressors); c++)
+			if (IsAdaptiveCompatible(AdaptiveCompressors[c], *param))
+				adaptiveComp.push_back(AdaptiveCompressors[c]);
+	}
+
+	// Encode blocks in parallel and merge them in the original order as soon as they are done
+	// Each block is recorded in a slot of a ring buffer; workers can't get more than 'window' blocks ahead of
+	// the merged one so memory doesn't depend on the number of blocks
+	i32 blockNum = param->numX * param->numY;
+	i32 threadNum = std::max(1, std::min((i32)std::thread::hardware_concurrency(), blockNum));
+	i32 window = threadNum * 4;
+	std::vector<ExporterRecorder> blockData(window, ExporterRecorder(param->format, param, exp->HasComments()));
+	std::vector<u8> blockDone(window, 0);
+	std::vector<u8> blockValid(window, 0);
+	BitmapBlockEncoder encoder = (param->comp == COMPRESS_Adaptive) ? NULL : GetBitmapBlockEncoder(param->bpc, param->comp, param->bUseTrans);
+	std::mutex lock;
+	std::condition_variable signal;
+	i32 nextBlock = 0;
+	i32 mergedNum = 0;
+	auto encodeBlocks = [&]()
+	{
+		ScratchArena arena; // One allocator per thread
+		for (;;)
+		{
+			i32 b;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				signal.wait(guard, [&]() { return (nextBlock >= blockNum) || (nextBlock < mergedNum + window); });
+				if (nextBlock >= blockNum)
+					return;
+				b = nextBlock++;
+			}
+			i32 slot = b % window;
+			arena.Reset();
+			u8 valid = ExportBitmapBlock(param, img, adaptiveComp, encoder, b % param->numX, b / param->numX, &blockData[slot], &arena) ? 1 : 0;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				blockValid[slot] = valid;
+				blockDone[slot] = 1;
+			}
+			signal.notify_all();
+		}
+	};
+	std::vector<std::thread> threads;
+	for (i32 t = 0; t < threadNum; t++)
+		threads.push_back(std::thread(encodeBlocks));
+
+	for (i32 b = 0; b < blockNum; b++)
+	{
+		i32 slot = b % window;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			signal.wait(guard, [&]() { return blockDone[slot] != 0; });
+		}
+		sprtAddr[b] = (u16)exp->GetTotalBytes();
+
+		// Print sprite header
+		exp->WriteSpriteHeader(b);
+
+		if (blockValid[slot])
+			blockData[slot].Replay(exp);
+		else
+			sprtAddr[b] = CMSXi_NO_ENTRY;
+		blockData[slot].Clear();
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			blockDone[slot] = 0;
+			mergedNum = b + 1;
+		}
+		signal.notify_all();
+	}
+	for (u32 t = 0; t < threads.size(); t++)
+		threads[t].join();
+	exp->WriteTableEnd(exp->HasComments() ? CMSX::Format("Total size : % i bytes", exp->GetTotalBytes()) : "");
+
+	//-------------------------------------------------------------------------
+	// INDEX TABLE
+
+	if (param->bAddIndex)
+	{
+		sprintf_s(strData, BUFFER_SIZE, "%s_index", param->tabName.c_str());
+		exp->WriteTableBegin(TABLE_U16, strData, "Images index");
+		for (i32 i = 0; i < (i32)sprtAddr.size(); i++)
+		{
+			exp->Write1WordLine(sprtAddr[i], "");
+		}
+		exp->WriteTableEnd("");
+	}
+
+	//-------------------------------------------------------------------------
+	// PALETTE TABLE
+
+	if (((param->bpc == 2) || (param->bpc == 4)) && (param->palType == PALETTE_Custom))
+	{
+		sprintf_s(strData, BUFFER_SIZE, "%s_palette", param->tabName.c_str());
+		exp->WriteTableBegin(TABLE_U8, strData, "Custom palette | Format: [X|R:3|X|B:3] [X:5|G:3]");
+		for (i32 i = 1; i <= param->palCount; i++)
+		{
+			RGB24 color(customPalette[i]);
+			u8 c1 = ((color.R >> 5) << 4) + (color.B >> 5);
+			u8 c2 = (color.G >> 5);
+			exp->Write2BytesLine(u8(c1), u8(c2), exp->HasComments() ? CMSX::Format("[%2i] #%06X", i, customPalette[i]) : "");
+		}
+		exp->WriteTableEnd("");
+	}
+
+	// Write file
+	bool bSaved = exp->Export();
+
+	return bSaved;
+}
+
+/** Build 256 colors palette */
+void Create256ColorsPalette(const char* filename)
+{
+	RGB24 ColorTable[256];
+	FILE* file;
+	// Create table
+	for(int i=0; i<256; i++)
+	{
+		ColorTable[i] = RGB24(GRB8(i));
+	}
+	// Save
+	fopen_s(&file, filename, "wb");
+	fwrite(ColorTable, sizeof(ColorTable), 1, file);
+	fclose(file);
+}
+
+/** Build 16 colors palette */
+void Create16ColorsPalette(const char* filename)
+{
+	RGB24 ColorTable[256];
+	FILE* file;
+	// Create table
+	for(int i=0; i<256; i++)
+	{
+		switch(i)
+		{
+			case 2:  ColorTable[i] = RGB24(36,  218, 36); break;
+			case 3:  ColorTable[i] = RGB24(109, 255, 109); break;
+			case 4:  ColorTable[i] = RGB24(36,  255, 36); break;
+			case 5:  ColorTable[i] = RGB24(72,  109, 255); break;
+			case 6:  ColorTable[i] = RGB24(182, 36,  36); break;
+			case 7:  ColorTable[i] = RGB24(72,  218, 255); break;
+			case 8:  ColorTable[i] = RGB24(255, 36,  36); break;
+			case 9:  ColorTable[i] = RGB24(255, 109, 109); break;
+			case 10: ColorTable[i] = RGB24(218, 218, 36); break;
+			case 11: ColorTable[i] = RGB24(218, 218, 145); break;
+			case 12: ColorTable[i] = RGB24(36,  145, 36); break;
+			case 13: ColorTable[i] = RGB24(218, 72,  182); break;
+			case 14: ColorTable[i] = RGB24(182, 182, 182); break;
+			case 15: ColorTable[i] = RGB24(255, 255, 255); break;
+			default: ColorTable[i] = RGB24(0, 0, 0);
+		}
+	}
+	// Save
+	fopen_s(&file, filename, "wb");
+	fwrite(ColorTable, sizeof(ColorTable), 1, file);
+	fclose(file);
+}
+
+//-----------------------------------------------------------------------------
+// EXPORT GRAPHIC 2
+//-----------------------------------------------------------------------------
+
+#define GM2_BANK_NUM	3	///< Number of pattern/color banks in Screen 2 (one for each third of the screen)
+#define GM2_BANK_ROWS	8	///< Number of tile rows in each screen third
+
+///
+struct Chunk
+{
+	u8 Pattern[8];
+	u8 Color[8];
+};
+
+/**
+ * Open-addressing hash index of a chunks list
+ * Chunks keep there insertion order in the list so IDs are the same than with a linear search.
+ */
+struct ChunkIndex
+{
+	std::vector<Chunk>& list;
+	std::vector<i32> slots;		///< Position in the list of the chunk stored in each slot (-1 if the slot is empty)
+
+	ChunkIndex(std::vector<Chunk>& l) : list(l), slots(1024, -1) {}
+
+	/// Hash the 16 bytes of a chunk (pattern and color as two 64-bits words)
+	/// A full 64-bits finalizer mixes every input bit in the low bits used as slot index
+	static u64 Hash(const Chunk& chunk)
+	{
+		u64 pattern, color;
+		memcpy(&pattern, chunk.Pattern, 8);
+		memcpy(&color, chunk.Color, 8);
+		u64 h = pattern ^ (color * 0x9E3779B97F4A7C15ULL);
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		return h ^ (h >> 33);
+	}
+
+	/// Get the position of the chunk in the list (add it at the end if not found)
+	i32 FindOrAdd(const Chunk& chunk)
+	{
+		u32 mask = (u32)slots.size() - 1;
+		for (u32 s = (u32)Hash(chunk) & mask; ; s = (s + 1) & mask)
+		{
+			if (slots[s] < 0)
+			{
+				slots[s] = (i32)list.size();
+				list.push_back(chunk);
+				if (list.size() * 2 > slots.size()) // Keep load factor under 50%
+					Grow();
+				return (i32)list.size() - 1;
+			}
+			if (memcmp(&list[slots[s]], &chunk, sizeof(Chunk)) == 0)
+				return slots[s];
+		}
+	}
+
+	/// Double the number of slots and re-insert all chunks
+	void Grow()
+	{
+		slots.assign(slots.size() * 2, -1);
+		u32 mask = (u32)slots.size() - 1;
+		for (i32 i = 0; i < (i32)list.size(); i++)
+		{
+			u32 s = (u32)Hash(list[i]) & mask;
+			while (slots[s] >= 0)
+				s = (s + 1) & mask;
+			slots[s] = i;
+		}
+	}
+};
+
+/// Convert the chunk to its canonical form: for each line, the lower color index is stored in the background nibble (pattern is inverted to match)
+/// Tiles that only differ by a foreground/background swap then share the same pattern/color entry
+void ValidateChunk(Chunk& chunk)
+{
+	for (u8 i = 0; i < 8; i++)
+	{
+		u8 c0 = chunk.Color[i] & 0xF;
+		u8 c1 = (chunk.Color[i] >> 4) & 0xF;
+		if (c1 < c0)
+		{
+			chunk.Color[i] = (c0 << 4) + c1;
+			chunk.Pattern[i] = ~chunk.Pattern[i];
+		}
+	}
+}
+
+/// Chunk converted to 4 bit-planes of the color index of its 64 pixels
+struct ChunkBitmap
+{
+	u64 Plane[4];
+
+	/// Build the bitmap from a chunk
+	void Set(const Chunk& chunk)
+	{
+		Plane[0] = Plane[1] = Plane[2] = Plane[3] = 0;
+		for (i32 j = 0; j < 8; j++)
+		{
+			for (i32 i = 0; i < 8; i++)
+			{
+				u8 c4 = (chunk.Pattern[j] & (1 << (7 - i))) ? (chunk.Color[j] >> 4) : (chunk.Color[j] & 0xF);
+				for (i32 p = 0; p < 4; p++)
+					if (c4 & (1 << p))
+						Plane[p] |= 1ULL << ((j * 8) + i);
+			}
+		}
+	}
+
+	/// Get the number of pixels that have a different color in the two bitmaps
+	static i32 Distance(const ChunkBitmap& a, const ChunkBitmap& b)
+	{
+		return GetBitCount((a.Plane[0] ^ b.Plane[0]) | (a.Plane[1] ^ b.Plane[1]) | (a.Plane[2] ^ b.Plane[2]) | (a.Plane[3] ^ b.Plane[3]));
+	}
+};
+
+/**
+ * BK-tree of chunk bitmaps for nearest neighbour search
+ * The pixel difference is a metric so the triangle inequality allow to skip most of the branches.
+ * Removed chunks stay in the tree to route the search but are never returned.
+ */
+struct ChunkTree
+{
+	static const i32 BRANCH = 65; ///< Possible distances between two chunks (0 to 64)
+
+	const std::vector<ChunkBitmap>& bitmaps;
+	std::vector<i32> children; ///< Child node for each distance (-1 if none)
+	std::vector<bool> active;
+
+	ChunkTree(const std::vector<ChunkBitmap>& b) : bitmaps(b)
+	{
+		children.assign(bitmaps.size() * BRANCH, -1);
+		active.assign(bitmaps.size(), true);
+		for (i32 i = 1; i < (i32)bitmaps.size(); i++)
+		{
+			i32 node = 0;
+			for (;;)
+			{
+				i32 d = ChunkBitmap::Distance(bitmaps[i], bitmaps[node]);
+				i32& child = children[node * BRANCH + d];
+				if (child < 0)
+				{
+					child = i;
+					break;
 				}
+				node = child;
+			}
+		}
+	}
+
+	/// Find the nearest active chunk (other than the given one)
+	/// @return Index of the nearest chunk or -1 if none
+	i32 FindNearest(i32 idx, i32& bestDist) const
+	{
+		i32 best = -1;
+		bestDist = BRANCH;
+		std::vector<i32> stack;
+		if (!bitmaps.empty())
+			stack.push_back(0);
+		while (!stack.empty())
+		{
+			i32 node = stack.back();
+			stack.pop_back();
+			i32 d = ChunkBitmap::Distance(bitmaps[idx], bitmaps[node]);
+			if ((node != idx) && active[node] && ((d < bestDist) || ((d == bestDist) && (node < best))))
+			{
+				best = node;
+				bestDist = d;
+			}
+			i32 min = std::max(d - bestDist, 0);
+			i32 max = std::min(d + bestDist, BRANCH - 1);
+			for (i32 k = min; k <= max; k++)
+			{
+				i32 child = children[node * BRANCH + k];
+				if (child >= 0)
+					stack.push_back(child);
+			}
+		}
+		return best;
+	}
+};
+
+/// Candidate merge of a chunk into its nearest neighbour
+struct ChunkMerge
+{
+	u32 Cost;		///< Number of pixels changed in the image
+	i32 From;		///< Chunk to remove
+	i32 To;			///< Chunk to use instead
+	u32 Version;	///< Version of the 'From' chunk when the candidate was computed
+
+	bool operator < (const ChunkMerge& m) const
+	{
+		// Reversed for a min-heap; ties are broken by index to stay deterministic
+		if (Cost != m.Cost)
+			return Cost > m.Cost;
+		return From > m.From;
+	}
+};
+
+/**
+ * Merge near-duplicate chunks until the list fit in the given budget
+ * Cheapest merge (pixel difference multiplied by the number of tiles using the chunk) is always done first.
+ * @param chunks	Chunks list to reduce (updated)
+ * @param uses		Number of tiles using each chunk
+ * @param remap		Receive the new index of each original chunk
+ * @return Total number of pixels changed in the image (each original chunk compared to its final replacement)
+ */
+u32 MergeChunks(std::vector<Chunk>& chunks, const std::vector<u32>& uses, std::vector<i32>& remap, i32 budget, i32 bank)
+{
+	i32 count = (i32)chunks.size();
+	remap.resize(count);
+	for (i32 i = 0; i < count; i++)
+		remap[i] = i;
+	if (count <= budget)
+		return 0;
+
+	std::vector<i32> mergedTo(remap);
+
+	std::vector<ChunkBitmap> bitmaps(count);
+	for (i32 i = 0; i < count; i++)
+		bitmaps[i].Set(chunks[i]);
+	ChunkTree tree(bitmaps);
+
+	std::vector<u32> weight(uses);
+	std::vector<u32> version(count, 0);
+	std::priority_queue<ChunkMerge> queue;
+	for (i32 i = 0; i < count; i++)
+	{
+		i32 dist;
+		i32 to = tree.FindNearest(i, dist);
+		ChunkMerge m = { (u32)dist * weight[i], i, to, 0 };
+		queue.push(m);
+	}
+
+	i32 remain = count;
+	while ((remain > budget) && !queue.empty())
+	{
+		ChunkMerge m = queue.top();
+		queue.pop();
+		if (!tree.active[m.From])
+			continue;
+		if ((m.To < 0) || !tree.active[m.To] || (m.Version != version[m.From])) // Outdated candidate
+		{
+			i32 dist;
+			m.To = tree.FindNearest(m.From, dist);
+			m.Cost = (u32)dist * weight[m.From];
+			m.Version = version[m.From];
+			if (m.To >= 0)
+				queue.push(m);
+			continue;
+		}
+		printf("Merge tile %i into %i in bank %i (error: %i pixels on %i tiles)\n", m.From, m.To, bank, m.Cost / std::max(weight[m.From], 1u), weight[m.From]);
+		tree.active[m.From] = false;
+		mergedTo[m.From] = m.To;
+		weight[m.To] += weight[m.From];
+		version[m.To]++;
+		remain--;
+	}
+
+	// Compact the remaining chunks
+	std::vector<i32> newIdx(count, -1);
+	std::vector<Chunk> kept;
+	for (i32 i = 0; i < count; i++)
+	{
+		if (tree.active[i])
+		{
+			newIdx[i] = (i32)kept.size();
+			kept.push_back(chunks[i]);
+		}
+	}
+	// Merges can be chained (A into B then B into C) so the error is measured against the original chunk
+	u32 totalError = 0;
+	for (i32 i = 0; i < count; i++)
+	{
+		i32 to = i;
+		while (!tree.active[to])
+			to = mergedTo[to];
+		remap[i] = newIdx[to];
+		totalError += (u32)ChunkBitmap::Distance(bitmaps[i], bitmaps[to]) * uses[i];
+	}
+	chunks.swap(kept);
+
+	return totalError;
+}
+
+/// Generate the chunk of the 8x8 pixels tile at the given image position
+/// @return Mask of the pixels (bit: j * 8 + i) that use more than 2 colors on their 8 pixels line
+u64 GetChunk(const DecodedImage* img, i32 x, i32 y, Chunk& chunk)
+{
+	u64 invalid = 0;
+	const u32* pixels = (const u32*)img->bits;
+	for (i32 j = 0; j < 8; j++)
+	{
+		u8 pattern = 0;
+		u8 colors[2];
+		i32 colorNum = 0;
+		for (i32 i = 0; i < 8; i++)
+		{
+			i32 idx = x + i + ((y + j) * img->imageX);
+			u32 c24 = 0xFFFFFF & pixels[idx];
+			u8 c4 = img->paletteLUT.GetNearestIndex(c24);
+			if (colorNum == 0) // special case: first color
+			{
+				colors[colorNum++] = c4;
+			}
+			else if ((colorNum == 1) && (c4 != colors[0])) // special case: second color
+			{
+				colors[colorNum++] = c4;
+			}
+
+			if (c4 == colors[0])
+				continue;
+			else if (c4 == colors[1])
+				pattern |= 1 << (7 - i);
+			else
+				invalid |= 1ULL << ((j * 8) + i);
+		}
+		if (colorNum == 1)
+			colors[colorNum++] = colors[0];
+
+		chunk.Pattern[j] = pattern;
+		chunk.Color[j] = (colors[1] << 4) + colors[0];
+	}
+	ValidateChunk(chunk);
+	return invalid;
+}
+
+/// Get the Screen 2 third (pattern/color bank) of a tile row of the image
+inline i32 GetGM2Bank(i32 tileY)
+{
+	return std::min(tileY / GM2_BANK_ROWS, GM2_BANK_NUM - 1);
+}
+
+/// Clamp the export area to the image and get the layers to export (the export area is the first layer)
+/// Layers are built in a local list so the same parameters can be exported several times (@see -compress best)
+void GetTileLayers(ExportParameters* param, const DecodedImage* img, std::vector<Layer>& layers)
+{
+	i32 imageX = img->imageX;
+	i32 imageY = img->imageY;
+
+	// Check image size
+	if ((param->sizeX == 0) || (param->sizeY == 0))
+	{
+		param->sizeX = imageX - param->posX;
+		param->sizeY = imageY - param->posY;
+	}
+	if ((param->posX + param->sizeX) > imageX)
+		param->sizeX = imageX - param->posX;
+	if ((param->posY + param->sizeY) > imageY)
+		param->sizeY = imageY - param->posY;
+
+	// Convert default extract param into a layer
+	{
+		Layer l;
+		l.posX = param->posX;
+		l.posY = param->posY;
+		l.numX = param->sizeX;
+		l.numY = param->sizeY;
+		layers.push_back(l);
+	}
+	layers.insert(layers.end(), param->layers.begin(), param->layers.end());
+}
+
+/// Generate the chunks of all layers
+/// Rows of tiles are processed in parallel; warnings are printed afterward in the image order.
+void GetLayerChunks(const std::vector<Layer>& layers, const DecodedImage* img, std::vector< std::vector<Chunk> >& layerChunks)
+{
+	struct TileRow { u32 layer; u32 row; };
+	std::vector<TileRow> rows;
+	std::vector< std::vector<u64> > layerInvalid(layers.size());
+	layerChunks.resize(layers.size());
+	for (u32 l = 0; l < layers.size(); l++)
+	{
+		const Layer* layer = &layers[l];
+		u32 numX = layer->numX / 8;
+		u32 numY = layer->numY / 8;
+		layerChunks[l].resize(numX * numY);
+		layerInvalid[l].resize(numX * numY);
+		for (u32 ny = 0; ny < numY; ny++)
+		{
+			TileRow r = { l, ny };
+			rows.push_back(r);
+		}
+	}
+
+	std::atomic<i32> nextRow(0);
+	auto extractRows = [&]()
+	{
+		for (i32 r = nextRow++; r < (i32)rows.size(); r = nextRow++)
+		{
+			u32 l = rows[r].layer;
+			u32 ny = rows[r].row;
+			const Layer* layer = &layers[l];
+			u32 numX = layer->numX / 8;
+			for (u32 nx = 0; nx < numX; nx++)
+				layerInvalid[l][nx + (ny * numX)] = GetChunk(img, layer->posX + (nx * 8), layer->posY + (ny * 8), layerChunks[l][nx + (ny * numX)]);
+		}
+	};
+	i32 threadNum = std::min((i32)std::thread::hardware_concurrency(), (i32)rows.size());
+	std::vector<std::thread> threads;
+	for (i32 t = 1; t < threadNum; t++)
+		threads.push_back(std::thread(extractRows));
+	extractRows();
+	for (u32 t = 0; t < threads.size(); t++)
+		threads[t].join();
+
+	// Report invalid lines
+	for (u32 l = 0; l < layers.size(); l++)
+	{
+		const Layer* layer = &layers[l];
+		u32 numX = layer->numX / 8;
+		for (u32 t = 0; t < layerInvalid[l].size(); t++)
+		{
+			for (u64 mask = layerInvalid[l][t]; mask; mask &= mask - 1)
+			{
+				u32 bit = GetLowestBit(mask);
+				printf("Warning: More than 2 colors on a 8 pixels line (%i, %i)\n", layer->posX + ((t % numX) * 8) + (bit & 7), layer->posY + ((t / numX) * 8) + (bit >> 3));
+			}
+		}
+	}
+}
+
+/***/
+bool ExportGM2(ExportParameters* param, const DecodedImage* img, ExporterInterface* exp)
+{
+	std::vector<Layer> layers;
+	GetTileLayers(param, img, layers);
+
+	//-------------------------------------------------------------------------
+	// Generate the chunks of all layers
+
+	std::vector< std::vector<Chunk> > layerChunks;
+	GetLayerChunks(layers, img, layerChunks);
+
+	//-------------------------------------------------------------------------
+	// Remove duplicated chunks
+	// All screen thirds share the same patterns/colors when possible, else each third get its own bank
+
+	i32 bankMax = 256 - param->offset;
+	std::vector<Chunk> bankChunks[GM2_BANK_NUM];
+	std::vector< std::vector<i32> > layerIds(layers.size());
+	bool bMultiBank = false;
+	for (i32 pass = 0; pass < 2; pass++)
+	{
+		ChunkIndex bankIndex[GM2_BANK_NUM] = { ChunkIndex(bankChunks[0]), ChunkIndex(bankChunks[1]), ChunkIndex(bankChunks[2]) };
+		for (u32 l = 0; l < layers.size(); l++)
+		{
+			const Layer* layer = &layers[l];
+			u32 numX = layer->numX / 8;
+			layerIds[l].resize(layerChunks[l].size());
+			for (u32 t = 0; t < layerChunks[l].size(); t++)
+			{
+				i32 bank = bMultiBank ? GetGM2Bank((layer->posY / 8) + (t / numX)) : 0;
+				layerIds[l][t] = bankIndex[bank].FindOrAdd(layerChunks[l][t]);
+			}
+		}
+		if (bMultiBank || ((i32)bankChunks[0].size() <= bankMax))
+			break;
+		bankChunks[0].clear();
+		bMultiBank = true;
+	}
+	i32 bankNum = bMultiBank ? GM2_BANK_NUM : 1;
+
+	// Merge near-duplicate chunks to fit in the tiles budget (lossy)
+	i32 mergeNum = 0;
+	u32 mergeError = 0;
+	if (param->tileBudget > 0)
+	{
+		i32 budget = std::min(param->tileBudget, bankMax);
+		std::vector<u32> bankUses[GM2_BANK_NUM];
+		for (i32 b = 0; b < bankNum; b++)
+			bankUses[b].assign(bankChunks[b].size(), 0);
+		for (u32 l = 0; l < layers.size(); l++)
+		{
+			u32 numX = layers[l].numX / 8;
+			for (u32 t = 0; t < layerIds[l].size(); t++)
+			{
+				i32 bank = bMultiBank ? GetGM2Bank((layers[l].posY / 8) + (t / numX)) : 0;
+				bankUses[bank][layerIds[l][t]]++;
+			}
+		}
+		std::vector<i32> bankRemap[GM2_BANK_NUM];
+		for (i32 b = 0; b < bankNum; b++)
+		{
+			i32 before = (i32)bankChunks[b].size();
+			mergeError += MergeChunks(bankChunks[b], bankUses[b], bankRemap[b], budget, b);
+			mergeNum += before - (i32)bankChunks[b].size();
+		}
+		for (u32 l = 0; l < layers.size(); l++)
+		{
+			u32 numX = layers[l].numX / 8;
+			for (u32 t = 0; t < layerIds[l].size(); t++)
+			{
+				i32 bank = bMultiBank ? GetGM2Bank((layers[l].posY / 8) + (t / numX)) : 0;
+				layerIds[l][t] = bankRemap[bank][layerIds[l][t]];
+			}
+		}
+		printf("%i tiles merged (total error: %i pixels)\n", mergeNum, mergeError);
+	}
+
+	for (i32 b = 0; b < bankNum; b++)
+		if ((i32)bankChunks[b].size() > bankMax)
+			printf("Warning: Bank %i contains %i unique patterns but only %i can be indexed (index will overflow)\n", b, (i32)bankChunks[b].size(), bankMax);
+
+	// File header
+	exp->WriteHeader();
+
+	for (u32 l = 0; l < layers.size(); l++)
+	{
+		Layer* layer = &layers[l];
+
+		//-------------------------------------------------------------------------
+		// NAMES TABLE
+
+		if(l == 0) // Default
+			exp->WriteTableBegin(TABLE_U8, param->tabName + "_Names", "Names Table");
+		else
+			exp->WriteTableBegin(TABLE_U8, CMSX::Format("%sL%i_Names", param->tabName.c_str(), l), "Names Table");
 
-				// Print sprite content
-				for (j = 0; j < param->sizeY; j++)
-				{
-					if ((j >= minY) && (j <= maxY))
-					{
-						// for line-crop, we need to recompute minX&maxX for each line
-						if (param->comp & COMPRESS_CropLine_Mask)
-						{
-							minX = param->sizeX;
-							maxX = 0;
-							for (i = 0; i < param->sizeX; i++)
-							{
-								i32 pixel = param->posX + i + (nx * (param->sizeX + param->gapX)) + ((param->posY + j + (ny * (param->sizeY + param->gapY))) * imageX);
-								u32 rgb = 0xFFFFFF & ((u32*)bits)[pixel];
-								if (rgb  != transRGB)
-								{
-									if (i < minX)
-										minX = i;
-									if (i > maxX)
-										maxX = i;
-								}
-							}
-							if (param->bpc == 1) // 1-bit black & white
-							{
-								minX &= 0xF8;	 // Round down 8
-								maxX |= 0x07;	 // Round up 8
-							}
-							else if (param->bpc == 2) // 2-bits index color palette
-							{
-								minX &= 0xFC;	 // Round down 4
-								maxX |= 0x03;	 // Round up 4
-							}
-							else if (param->bpc == 4) // 4-bits index color palette
-							{
-								minX &= 0xFE;	 // Round down 2
-								maxX |= 0x01;	 // Round up 2
-							}
-
-							// Add row range info
-							if (param->comp == COMPRESS_CropLine16)
-							{
-								minX &= 0x0F;	// Clamp to 4-bits (0-15)
-								maxX &= 0x0F;	// Clamp to 4-bits (0-15)
-								exp->Write1ByteLine(u8((minX << 4) + maxX), "[minX:4|maxX:4]");
-							}
-							else if (param->comp == COMPRESS_CropLine32)
-							{
-								minX &= 0x07;	// Clamp to 3-bits (0-7)
-								maxX &= 0x1F;	// Clamp to 5-bits (0-31)
-								exp->Write1ByteLine(u8(((minX) << 5) + maxX), "[minX:3|maxX:5]");
-							}
-							else if (param->comp == COMPRESS_CropLine256)
-							{
-								exp->Write2BytesLine(u8(minX), u8(maxX), "[minX] [maxX]");
-							}
-						}
+		u32 numX = layer->numX / 8;
+		u32 numY = layer->numY / 8;
 
-						// Add sprinte data
-						exp->WriteLineBegin();
-						byte = 0;
-						for (i = 0; i < param->sizeX; i++)
-						{
-							if ((i >= minX) && (i <= maxX))
-							{
-								i32 pixel = param->posX + i + (nx * (param->sizeX + param->gapX)) + ((param->posY + j + (ny * (param->sizeY + param->gapY))) * imageX);
-								u32 rgb = 0xFFFFFF & ((u32*)bits)[pixel];
-								//-----------------------------------------------------------------
-								if (param->bpc == 8) // 8-bits GBR color
-								{
-									// convert to 8 bits GRB
-									c8 = GetGBR8(rgb, param->bUseTrans, transRGB);
-									exp->Write1ByteData((u8)c8);
-								}
-								//-----------------------------------------------------------------
-								else if (param->bpc == 4) // 4-bits index color palette
-								{
-									u32* pal = (param->palType == PALETTE_MSX1) ? PaletteMSX : customPalette;
-									if (param->bUseTrans)
-										c4 = (rgb == transRGB) ? 0x0 : GetNearestColorIndex(rgb, pal, param->palCount);
-									else
-										c4 = GetNearestColorIndex(rgb, pal, param->palCount);
-									c4 &= 0x0F;
-
-									if ((i & 0x1) == 0)
-										byte |= (c4 << 4); // First pixel use higher bits
-									else // ((i & 0x1) == 1)
-										byte |= c4; // Second pixel use lower bits
-									if (((i & 0x1) == 1) || (i == maxX))
-									{
-										exp->Write1ByteData(byte);
-										byte = 0;
-									}
-								}
-								//-----------------------------------------------------------------
-								else if (param->bpc == 2) // 2-bits index color palette
-								{
-									u32* pal = (param->palType == PALETTE_MSX1) ? PaletteMSX : customPalette;
-									if (param->bUseTrans)
-										c2 = (rgb == transRGB) ? 0x0 : GetNearestColorIndex(rgb, pal, param->palCount);
-									else
-										c2 = GetNearestColorIndex(rgb, pal, param->palCount);
-									c2 &= 0x03;
-
-									if ((i & 0x3) == 0)
-										byte |= (c2 << 6); // First pixel
-									else if ((i & 0x3) == 1)
-										byte |= (c2 << 4); // Second pixel
-									else if ((i & 0x3) == 2)
-										byte |= (c2 << 2); // Third  pixel
-									else // ((i & 0x3) == 3)
-										byte |= c2; // Fourth pixel
-
-									if (((i & 0x3) == 3) || (i == maxX))
-									{
-										exp->Write1ByteData(byte);
-										byte = 0;
-									}
-								}
-								//-----------------------------------------------------------------
-								else if (param->bpc == 1) // Black & white
-								{
-									bit = pixel & 0x7;
-									if (param->bUseTrans)
-									{
-										if (rgb != transRGB) // All non-transparent color are 1
-											byte |= 1 << (7 - bit);
-									}
-									else
-									{
-										if (rgb != 0) // All non-black color are 1
-											byte |= 1 << (7 - bit);
-									}
-									if (((pixel & 0x7) == 0x7) || (i == maxX))
-									{
-										exp->Write8BitsData(byte);
-										byte = 0;
-									}
-								}
-							}
-						}
-						exp->WriteLineEnd();
-					}
-				}
+		std::vector<u8> row(numX);
+		for (u32 ny = 0; ny < numY; ny++)
+		{
+			for (u32 nx = 0; nx < numX; nx++)
+			{
+				u8 patIdx = (u8)layerIds[l][nx + (ny * numX)];
+				row[nx] = patIdx + param->offset;
 			}
+			exp->WriteRow(row.data(), numX);
 		}
+		exp->WriteTableEnd("");
+	}
+	i32 namesSize = exp->GetTotalBytes();
+	if (exp->HasComments())
+	{
+		exp->WriteCommentLine(CMSX::Format("Names size: %i Bytes", namesSize));
+		if (bMultiBank)
+		{
+			for (i32 b = 0; b < bankNum; b++)
+				exp->WriteCommentLine(CMSX::Format("Bank %i: %i/%i patterns", b, (i32)bankChunks[b].size(), bankMax));
+		}
+		if (mergeNum > 0)
+			exp->WriteCommentLine(CMSX::Format("Merged tiles: %i (error: %i pixels)", mergeNum, mergeError));
 	}
-	sprintf_s(strData, BUFFER_SIZE, "Total size : % i bytes", exp->GetTotalBytes());
-	exp->WriteTableEnd(strData);
-
-	delete bits;
 
 	//-------------------------------------------------------------------------
-	// INDEX TABLE
+	// PATTERNS TABLE
 
-	if (param->bAddIndex)
+	for (i32 b = 0; b < bankNum; b++)
 	{
-		sprintf_s(strData, BUFFER_SIZE, "%s_index", param->tabName.c_str());
-		exp->WriteTableBegin(TABLE_U16, strData, "Images index");
-		for (i32 i = 0; i < (i32)sprtAddr.size(); i++)
+		const std::vector<Chunk>& chunkList = bankChunks[b];
+		i32 tableStart = exp->GetTotalBytes();
+		if (bMultiBank)
+			exp->WriteTableBegin(TABLE_U8, CMSX::Format("%s_Patterns%i", param->tabName.c_str(), b), exp->HasComments() ? CMSX::Format("Patterns Table (bank %i)", b) : "");
+		else
+			exp->WriteTableBegin(TABLE_U8, param->tabName + "_Patterns", "Patterns Table");
+		if (param->comp == COMPRESS_RLEp)
 		{
-			exp->Write1WordLine(sprtAddr[i], "");
+			std::vector<u8> bytes;
+			for (i32 i = 0; i < (i32)chunkList.size(); i++)
+				for (i32 j = 0; j < 8; j++)
+					bytes.push_back(chunkList[i].Pattern[j]);
+			ExportRLEp(param, exp, bytes);
 		}
-		exp->WriteTableEnd("");
+		else
+		{
+			for (i32 i = 0; i < (i32)chunkList.size(); i++)
+			{
+				// Print sprite header
+				exp->WriteSpriteHeader(i + param->offset);
+				for (i32 j = 0; j < 8; j++)
+				{
+					exp->WriteLineBegin();
+					exp->Write8BitsData(chunkList[i].Pattern[j]);
+					exp->WriteLineEnd();
+				}
+			}
+		}
+		i32 patternsSize = exp->GetTotalBytes() - tableStart;
+		exp->WriteTableEnd(exp->HasComments() ? CMSX::Format("Patterns size: %i Bytes", patternsSize) : "");
 	}
 
 	//-------------------------------------------------------------------------
-	// PALETTE TABLE
+	// COLORS TABLE
 
-	if (((param->bpc == 2) || (param->bpc == 4)) && (param->palType == PALETTE_Custom))
+	for (i32 b = 0; b < bankNum; b++)
 	{
-		sprintf_s(strData, BUFFER_SIZE, "%s_palette", param->tabName.c_str());
-		exp->WriteTableBegin(TABLE_U8, strData, "Custom palette | Format: [X|R:3|X|B:3] [X:5|G:3]");
-		for (i32 i = 1; i <= param->palCount; i++)
+		const std::vector<Chunk>& chunkList = bankChunks[b];
+		i32 tableStart = exp->GetTotalBytes();
+		if (bMultiBank)
+			exp->WriteTableBegin(TABLE_U8, CMSX::Format("%s_Colors%i", param->tabName.c_str(), b), exp->HasComments() ? CMSX::Format("Colors Table (bank %i)", b) : "");
+		else
+			exp->WriteTableBegin(TABLE_U8, param->tabName + "_Colors", "Colors Table");
+		if (param->comp == COMPRESS_RLEp)
 		{
-			RGB24 color(customPalette[i]);
-			u8 c1 = ((color.R >> 5) << 4) + (color.B >> 5);
-			u8 c2 = (color.G >> 5);
-			sprintf_s(strData, BUFFER_SIZE, "[%2i] #%06X", i, customPalette[i]);
-			exp->Write2BytesLine(u8(c1), u8(c2), strData);
+			std::vector<u8> bytes;
+			for (i32 i = 0; i < (i32)chunkList.size(); i++)
+				for (i32 j = 0; j < 8; j++)
+					bytes.push_back(chunkList[i].Color[j]);
+			ExportRLEp(param, exp, bytes);
 		}
-		exp->WriteTableEnd("");
+		else
+		{
+			for (i32 i = 0; i < (i32)chunkList.size(); i++)
+			{
+				// Print sprite header
+				exp->WriteSpriteHeader(i + param->offset);
+				exp->WriteRow(chunkList[i].Color, 8);
+			}
+		}
+		i32 colorsSize = exp->GetTotalBytes() - tableStart;
+		exp->WriteTableEnd(exp->HasComments() ? CMSX::Format("Colors size: %i Bytes", colorsSize) : "");
 	}
+	exp->WriteLineEnd();
+	if (exp->HasComments())
+		exp->WriteCommentLine(CMSX::Format("Total size: %i Bytes", exp->GetTotalBytes()));
 
+	//-------------------------------------------------------------------------
 	// Write file
 	bool bSaved = exp->Export();
 
 	return bSaved;
 }
 
-/** Build 256 colors palette */
-void Create256ColorsPalette(const char* filename)
-{
-	RGB24 ColorTable[256];
-	FILE* file;
-	// Create table
-	for(int i=0; i<256; i++)
-	{
-		ColorTable[i] = RGB24(GRB8(i));
-	}
-	// Save
-	fopen_s(&file, filename, "wb");
-	fwrite(ColorTable, sizeof(ColorTable), 1, file);
-	fclose(file);
-}
-
-/** Build 16 colors palette */
-void Create16ColorsPalette(const char* filename)
-{
-	RGB24 ColorTable[256];
-	FILE* file;
-	// Create table
-	for(int i=0; i<256; i++)
-	{
-		switch(i)
-		{
-			case 2:  ColorTable[i] = RGB24(36,  218, 36); break;
-			case 3:  ColorTable[i] = RGB24(109, 255, 109); break;
-			case 4:  ColorTable[i] = RGB24(36,  255, 36); break;
-			case 5:  ColorTable[i] = RGB24(72,  109, 255); break;
-			case 6:  ColorTable[i] = RGB24(182, 36,  36); break;
-			case 7:  ColorTable[i] = RGB24(72,  218, 255); break;
-			case 8:  ColorTable[i] = RGB24(255, 36,  36); break;
-			case 9:  ColorTable[i] = RGB24(255, 109, 109); break;
-			case 10: ColorTable[i] = RGB24(218, 218, 36); break;
-			case 11: ColorTable[i] = RGB24(218, 218, 145); break;
-			case 12: ColorTable[i] = RGB24(36,  145, 36); break;
-			case 13: ColorTable[i] = RGB24(218, 72,  182); break;
-			case 14: ColorTable[i] = RGB24(182, 182, 182); break;
-			case 15: ColorTable[i] = RGB24(255, 255, 255); break;
-			default: ColorTable[i] = RGB24(0, 0, 0);
-		}
-	}
-	// Save
-	fopen_s(&file, filename, "wb");
-	fwrite(ColorTable, sizeof(ColorTable), 1, file);
-	fclose(file);
-}
-
 //-----------------------------------------------------------------------------
 // EXPORT GRAPHIC 1
 //-----------------------------------------------------------------------------
 
-/***/
-bool ExportGM1(ExportParameters* param, ExporterInterface* exp)
-{
-	return false;
-}
-
-//-----------------------------------------------------------------------------
-// EXPORT GRAPHIC 2
-//-----------------------------------------------------------------------------
-
-///
-struct Chunk
-{
-	u8 Pattern[8];
-	u8 Color[8];
-};
+#define GM1_GROUP_NUM	32	///< Number of color groups in Screen 1 color table
+#define GM1_GROUP_SIZE	8	///< Number of patterns sharing the same color byte
 
-///
-u8 GetChunkId(std::vector<Chunk>& list, const Chunk& chunk)
+/// Convert a GM2 chunk (one color byte per line) into a GM1 tile (one color byte for the whole tile)
+/// All the lines get the same canonical color byte (lower color index in the background nibble)
+void GetTileChunk(Chunk& chunk, i32 x, i32 y)
 {
-	for (u8 i = 0; i < list.size(); i++)
+	// Get the colors used in the tile
+	u16 used = 0;
+	for (i32 j = 0; j < 8; j++)
 	{
-		if (memcmp(&list[i], &chunk, sizeof(Chunk)) == 0)
-			return i;
+		if (chunk.Pattern[j] != 0xFF)
+			used |= 1 << (chunk.Color[j] & 0xF);
+		if (chunk.Pattern[j] != 0x00)
+			used |= 1 << (chunk.Color[j] >> 4);
 	}
-	list.push_back(chunk);
-	return (u8)(list.size() - 1);
-}
+	u8 bg = (u8)GetLowestBit(used);
+	u8 fg = (u8)GetHighestBit(used);
+	if (used & ~((1 << bg) | (1 << fg)))
+		printf("Warning: More than 2 colors in a 8x8 tile (%i, %i)\n", x, y);
 
-///
-void ValidateChunk(Chunk& chunk)
-{
-	for (u8 i = 0; i < 8; i++)
+	// Rebuild the patterns for the tile colors
+	for (i32 j = 0; j < 8; j++)
 	{
-		u8 c0 = chunk.Color[i] & 0xF;
-		u8 c1 = (chunk.Color[i] >> 4) & 0xF;
-		if (c1 < c0)
+		u8 pattern = 0;
+		for (i32 i = 0; i < 8; i++)
 		{
-			chunk.Color[i] = (c0 << 4) + c1;
-			chunk.Pattern[i] = ~chunk.Pattern[i];
+			u8 c4 = (chunk.Pattern[j] & (1 << (7 - i))) ? (chunk.Color[j] >> 4) : (chunk.Color[j] & 0xF);
+			if ((c4 == fg) && (fg != bg))
+				pattern |= 1 << (7 - i);
 		}
+		chunk.Pattern[j] = pattern;
+		chunk.Color[j] = (fg << 4) + bg;
 	}
 }
 
-///
-void ExportRLEp(ExportParameters* param, ExporterInterface* exp, const std::vector<u8>& data)
+/**
+ * Assign each unique tile to a pattern slot so that tiles sharing the same colors are in the same group of 8 patterns
+ * Two-colors tiles open a group for their color pair; single-color tiles first fill the free slots of groups using their color,
+ * then share new groups by pair of colors.
+ * @param tiles		Unique tiles (patterns of single-color tiles are updated to match their group)
+ * @param tileSlot	Receive the pattern slot of each tile (-1 if it doesn't fit)
+ * @param groupColor Receive the color byte of each group (-1 if unused)
+ * @return Number of tiles that can't be placed
+ */
+i32 AllocateTileGroups(std::vector<Chunk>& tiles, std::vector<i32>& tileSlot, i32* groupColor, i32 firstSlot)
 {
-	u32 chunk = 0;
-	for(u32 i = 0; i < data.size(); i++)
+	i32 groupUsed[GM1_GROUP_NUM];
+	for (i32 g = 0; g < GM1_GROUP_NUM; g++)
 	{
-		u8 key = data[i];
-		u8 len = 1;
-		while ((i + 1 < data.size()) && (data[i + 1] == key))
-		{
-			len++;
-			i++;
-		}
-		if (len > 1)  // Repeating patterns
+		groupColor[g] = -1;
+		groupUsed[g] = std::max(0, std::min(firstSlot - (g * GM1_GROUP_SIZE), GM1_GROUP_SIZE));
+	}
+	i32 nextGroup = firstSlot / GM1_GROUP_SIZE;
+	i32 pairGroup[256]; // Current group of each color pair
+	for (i32 i = 0; i < 256; i++)
+		pairGroup[i] = -1;
+
+	tileSlot.assign(tiles.size(), -1);
+	i32 lost = 0;
+
+	// Two-colors tiles
+	for (i32 t = 0; t < (i32)tiles.size(); t++)
+	{
+		u8 color = tiles[t].Color[0];
+		if ((color >> 4) == (color & 0xF))
+			continue;
+		i32 g = pairGroup[color];
+		if ((g < 0) || (groupUsed[g] == GM1_GROUP_SIZE))
 		{
-			u8 type = (key == 0) ? 0 : 1;
-			exp->WriteCommentLine(CMSX::Format("Chunk[%i]", chunk++));
-			exp->Write1ByteLine((type << 6) | len, CMSX::Format("Type=%i, Length=%i", type, len));
-			if (type == 1)
+			if (nextGroup >= GM1_GROUP_NUM)
 			{
-				exp->WriteLineBegin();
-				exp->Write8BitsData(key);
-				exp->WriteLineEnd();
+				lost++;
+				continue;
 			}
+			g = pairGroup[color] = nextGroup++;
+			groupColor[g] = color;
 		}
-		else // Uncompressed data
-		{
-			u8 type = 3;
-			std::vector<u8> block;
-			block.push_back(key);
-			while ((i + 2 < data.size()) && (data[i + 1] != key) && (data[i + 2] != data[i + 1]))
+		tileSlot[t] = (g * GM1_GROUP_SIZE) + groupUsed[g]++;
+	}
+
+	// Single-color tiles
+	for (i32 t = 0; t < (i32)tiles.size(); t++)
+	{
+		u8 c4 = tiles[t].Color[0] & 0xF;
+		if ((tiles[t].Color[0] >> 4) != c4)
+			continue;
+		// Search a group using this color, else a group with an open foreground color
+		i32 g = -1;
+		for (i32 i = 0; (i < nextGroup) && (g < 0); i++)
+			if ((groupColor[i] >= 0) && (groupUsed[i] < GM1_GROUP_SIZE) && (((groupColor[i] & 0xF) == c4) || ((groupColor[i] >> 4) == c4)))
+				g = i;
+		for (i32 i = 0; (i < nextGroup) && (g < 0); i++)
+			if ((groupColor[i] >= 0) && (groupUsed[i] < GM1_GROUP_SIZE) && ((groupColor[i] >> 4) == (groupColor[i] & 0xF)))
 			{
-				key = data[i + 1];
-				block.push_back(key);
-				len++;
-				i++;
+				g = i;
+				groupColor[g] = (c4 << 4) + (groupColor[g] & 0xF);
 			}
-			exp->WriteCommentLine(CMSX::Format("Chunk[%i]", chunk++));
-			exp->Write1ByteLine((type << 6) | len, CMSX::Format("Type=%i, Length=%i", type, len));
-			for(u32 j = 0; j < block.size(); j++)
+		if (g < 0)
+		{
+			if (nextGroup >= GM1_GROUP_NUM)
 			{
-				exp->WriteLineBegin();
-				exp->Write8BitsData(block[j]);
-				exp->WriteLineEnd();
+				lost++;
+				continue;
 			}
+			g = nextGroup++;
+			groupColor[g] = (c4 << 4) + c4;
 		}
-
+		u8 pattern = ((groupColor[g] & 0xF) == c4) ? 0x00 : 0xFF;
+		for (i32 j = 0; j < 8; j++)
+			tiles[t].Pattern[j] = pattern;
+		tileSlot[t] = (g * GM1_GROUP_SIZE) + groupUsed[g]++;
 	}
-	exp->WriteCommentLine("Zero terminator");
-	exp->Write1ByteLine(0x00, "");
+
+	return lost;
 }
 
 /***/
-bool ExportGM2(ExportParameters* param, ExporterInterface* exp)
+bool ExportGM1(ExportParameters* param, const DecodedImage* img, ExporterInterface* exp)
 {
-	std::vector<Chunk> chunkList;
-	FIBITMAP* dib, * dib32;
+	std::vector<Layer> layers;
+	GetTileLayers(param, img, layers);
 
 	//-------------------------------------------------------------------------
-	// Prepare image
-
-	dib = LoadImage(param->inFile.c_str()); // open and load the file using the default load option
-	if (dib == NULL)
-	{
-		printf("Error: Fail to load %s\n", param->inFile.c_str());
-		return false;
-	}
+	// Generate the tiles of all layers and remove duplicated ones
 
-	// Get 32 bits raw datas
-	dib32 = FreeImage_ConvertTo32Bits(dib);
-	FreeImage_Unload(dib); // free the original dib
-	i32 imageX = FreeImage_GetWidth(dib32);
-	i32 imageY = FreeImage_GetHeight(dib32);
-	i32 scanWidth = FreeImage_GetPitch(dib32);
-	i32 bpp = FreeImage_GetBPP(dib32);
-	BYTE* bits = new BYTE[scanWidth * imageY];
-	FreeImage_ConvertToRawBits(bits, dib32, scanWidth, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
-	FreeImage_Unload(dib32);
+	std::vector< std::vector<Chunk> > layerChunks;
+	GetLayerChunks(layers, img, layerChunks);
 
-	// Check image size
-	if ((param->sizeX == 0) || (param->sizeY == 0))
+	std::vector<Chunk> tiles;
+	ChunkIndex tileIndex(tiles);
+	std::vector< std::vector<i32> > layerIds(layers.size());
+	for (u32 l = 0; l < layers.size(); l++)
 	{
-		param->sizeX = imageX - param->posX;
-		param->sizeY = imageY - param->posY;
+		const Layer* layer = &layers[l];
+		u32 numX = layer->numX / 8;
+		layerIds[l].resize(layerChunks[l].size());
+		for (u32 t = 0; t < layerChunks[l].size(); t++)
+		{
+			GetTileChunk(layerChunks[l][t], layer->posX + ((t % numX) * 8), layer->posY + ((t / numX) * 8));
+			layerIds[l][t] = tileIndex.FindOrAdd(layerChunks[l][t]);
+		}
 	}
-	if ((param->posX + param->sizeX) > imageX)
-		param->sizeX = imageX - param->posX;
-	if ((param->posY + param->sizeY) > imageY)
-		param->sizeY = imageY - param->posY;
 
-	// Convert default extract param into a layer
-	{
-		Layer l;
-		l.posX = param->posX;
-		l.posY = param->posY;
-		l.numX = param->sizeX;
-		l.numY = param->sizeY;
-		param->layers.insert(param->layers.begin(), l);
-	}
+	//-------------------------------------------------------------------------
+	// Assign the tiles to color groups
+
+	std::vector<i32> tileSlot;
+	i32 groupColor[GM1_GROUP_NUM];
+	i32 lost = AllocateTileGroups(tiles, tileSlot, groupColor, param->offset);
+	if (lost > 0)
+		printf("Warning: %i unique tiles don't fit in the %i color groups (their index is set to %i)\n", lost, GM1_GROUP_NUM, param->offset);
+	i32 lastSlot = param->offset - 1;
+	for (i32 t = 0; t < (i32)tiles.size(); t++)
+		lastSlot = std::max(lastSlot, tileSlot[t]);
+	std::vector<i32> slotTile(256, -1);
+	for (i32 t = 0; t < (i32)tiles.size(); t++)
+		if (tileSlot[t] >= 0)
+			slotTile[tileSlot[t]] = t;
+	i32 groupNum = 0;
+	for (i32 g = 0; g < GM1_GROUP_NUM; g++)
+		if (groupColor[g] >= 0)
+			groupNum++;
 
 	// File header
 	exp->WriteHeader();
 
-	for (u32 l = 0; l < param->layers.size(); l++)
+	for (u32 l = 0; l < layers.size(); l++)
 	{
-		Layer* layer = &param->layers[l];
+		Layer* layer = &layers[l];
 
 		//-------------------------------------------------------------------------
 		// NAMES TABLE
@@ -890,121 +2601,83 @@ bool ExportGM2(ExportParameters* param, ExporterInterface* exp)
 		u32 numX = layer->numX / 8;
 		u32 numY = layer->numY / 8;
 
-		// Parse image
+		std::vector<u8> row(numX);
 		for (u32 ny = 0; ny < numY; ny++)
 		{
-			exp->WriteLineBegin();
 			for (u32 nx = 0; nx < numX; nx++)
 			{
-				Chunk chunk;
-
-				// Generate chunk
-				for (i32 j = 0; j < 8; j++)
-				{
-					u8 pattern = 0;
-					std::vector<u8> colors;
-					for (i32 i = 0; i < 8; i++)
-					{
-						i32 idx = layer->posX + i + (nx * 8) + ((layer->posY + j + (ny * 8)) * imageX);
-						u32 c24 = 0xFFFFFF & ((u32*)bits)[idx];
-						u8 c4 = GetNearestColorIndex(c24, PaletteMSX, 16);
-						if (colors.empty()) // special case: first color
-						{
-							colors.push_back(c4);
-						}
-						else if ((colors.size() == 1) && (c4 != colors[0])) // special case: second color
-						{
-							colors.push_back(c4);
-						}
-
-						if (c4 == colors[0])
-							continue;
-						else if (c4 == colors[1])
-							pattern |= 1 << (7 - i);
-						else
-							printf("Warning: More than 2 colors on a 8 pixels line (%i, %i)\n", layer->posX + i + (nx * 8), layer->posY + j + (ny * 8));
-					}
-					if (colors.size() == 1)
-						colors.push_back(colors[0]);
-
-					chunk.Pattern[j] = pattern;
-					chunk.Color[j] = (colors[1] << 4) + colors[0];
-				}
-
-				u8 patIdx = GetChunkId(chunkList, chunk);
-				exp->Write1ByteData(patIdx + param->offset);
+				i32 slot = tileSlot[layerIds[l][nx + (ny * numX)]];
+				row[nx] = (slot >= 0) ? (u8)slot : param->offset;
 			}
-			exp->WriteLineEnd();
+			exp->WriteRow(row.data(), numX);
 		}
 		exp->WriteTableEnd("");
 	}
 	i32 namesSize = exp->GetTotalBytes();
-	exp->WriteCommentLine(CMSX::Format("Names size: %i Bytes", namesSize));
-
-	delete bits;
-
-	//for (i32 i = 0; i < (i32)chunkList.size(); i++)
-	//	ValidateChunk(chunkList[i]);
+	if (exp->HasComments())
+	{
+		exp->WriteCommentLine(CMSX::Format("Names size: %i Bytes", namesSize));
+		exp->WriteCommentLine(CMSX::Format("Tiles: %i/%i (color groups: %i/%i)", (i32)tiles.size() - lost, 256 - param->offset, groupNum, GM1_GROUP_NUM));
+	}
 
 	//-------------------------------------------------------------------------
 	// PATTERNS TABLE
 
+	i32 tableStart = exp->GetTotalBytes();
 	exp->WriteTableBegin(TABLE_U8, param->tabName + "_Patterns", "Patterns Table");
 	if (param->comp == COMPRESS_RLEp)
 	{
 		std::vector<u8> bytes;
-		for (i32 i = 0; i < (i32)chunkList.size(); i++)
+		for (i32 s = param->offset; s <= lastSlot; s++)
 			for (i32 j = 0; j < 8; j++)
-				bytes.push_back(chunkList[i].Pattern[j]);
+				bytes.push_back((slotTile[s] >= 0) ? tiles[slotTile[s]].Pattern[j] : 0);
 		ExportRLEp(param, exp, bytes);
 	}
 	else
 	{
-		for (i32 i = 0; i < (i32)chunkList.size(); i++)
+		for (i32 s = param->offset; s <= lastSlot; s++)
 		{
 			// Print sprite header
-			exp->WriteSpriteHeader(i + param->offset);
+			exp->WriteSpriteHeader(s);
 			for (i32 j = 0; j < 8; j++)
 			{
 				exp->WriteLineBegin();
-				exp->Write8BitsData(chunkList[i].Pattern[j]);
+				exp->Write8BitsData((slotTile[s] >= 0) ? tiles[slotTile[s]].Pattern[j] : 0);
 				exp->WriteLineEnd();
 			}
 		}
 	}
-	i32 patternsSize = exp->GetTotalBytes() - namesSize;
-	exp->WriteTableEnd(CMSX::Format("Patterns size: %i Bytes", patternsSize));
+	i32 patternsSize = exp->GetTotalBytes() - tableStart;
+	exp->WriteTableEnd(exp->HasComments() ? CMSX::Format("Patterns size: %i Bytes", patternsSize) : "");
 
 	//-------------------------------------------------------------------------
 	// COLORS TABLE
 
+	// Like the patterns table, the colors table start at the group of the offset slot (groups reserved by the offset are left untouched)
+	i32 firstGroup = param->offset / GM1_GROUP_SIZE;
+	i32 lastGroup = lastSlot / GM1_GROUP_SIZE;
+	tableStart = exp->GetTotalBytes();
 	exp->WriteTableBegin(TABLE_U8, param->tabName + "_Colors", "Colors Table");
+	if ((firstGroup > 0) && exp->HasComments())
+		exp->WriteCommentLine(CMSX::Format("Start at group %i: load at colors table address + %i", firstGroup, firstGroup));
+	u8 colors[GM1_GROUP_NUM];
+	for (i32 g = 0; g < GM1_GROUP_NUM; g++)
+		colors[g] = (groupColor[g] >= 0) ? (u8)groupColor[g] : 0;
 	if (param->comp == COMPRESS_RLEp)
 	{
-		std::vector<u8> bytes;
-		for (i32 i = 0; i < (i32)chunkList.size(); i++)
-			for (i32 j = 0; j < 8; j++)
-				bytes.push_back(chunkList[i].Color[j]);
+		std::vector<u8> bytes(colors + firstGroup, colors + lastGroup + 1);
 		ExportRLEp(param, exp, bytes);
 	}
 	else
 	{
-		for (i32 i = 0; i < (i32)chunkList.size(); i++)
-		{
-			// Print sprite header
-			exp->WriteSpriteHeader(i + param->offset);
-			exp->WriteLineBegin();
-			for (i32 j = 0; j < 8; j++)
-			{
-				exp->Write1ByteData(chunkList[i].Color[j]);
-			}
-			exp->WriteLineEnd();
-		}
+		for (i32 g = firstGroup; g <= lastGroup; g += 8)
+			exp->WriteRow(colors + g, std::min(8, lastGroup + 1 - g));
 	}
-	i32 colorsSize = exp->GetTotalBytes() - namesSize - patternsSize;
-	exp->WriteTableEnd(CMSX::Format("Colors size: %i Bytes", colorsSize));
+	i32 colorsSize = exp->GetTotalBytes() - tableStart;
+	exp->WriteTableEnd(exp->HasComments() ? CMSX::Format("Colors size: %i Bytes", colorsSize) : "");
 	exp->WriteLineEnd();
-	exp->WriteCommentLine(CMSX::Format("Total size: %i Bytes", exp->GetTotalBytes()));
+	if (exp->HasComments())
+		exp->WriteCommentLine(CMSX::Format("Total size: %i Bytes", exp->GetTotalBytes()));
 
 	//-------------------------------------------------------------------------
 	// Write file
@@ -1017,25 +2690,79 @@ bool ExportGM2(ExportParameters* param, ExporterInterface* exp)
 // EXPORT SPRITES
 //-----------------------------------------------------------------------------
 
-/// Convert color to binary value according to layer configuration
-i32 ColorToBinary(Layer& layer, u32 c24)
+/**
+ * Image pre-mapped to the colors of the layers
+ * Each color used by a layer get a small ID (0 is for all other colors) so the binary value of a pixel for a layer is a single bit test.
+ */
+struct LayerColorMap
 {
-	std::vector<u32>::iterator it;
+	std::vector<u32> colors;					///< Sorted colors used by the layers (ID is index + 1)
+	std::vector<u16> plane;						///< Color ID of each pixel of the image
+	std::vector< std::vector<u64> > layerBits;	///< Binary value of each color ID for each layer
+
+	/// Map the image pixels and compile the color set of each layer
+	void Build(const std::vector<Layer>& layers, const DecodedImage* img)
+	{
+		colors.clear();
+		for (u32 l = 0; l < layers.size(); l++)
+			colors.insert(colors.end(), layers[l].colors.begin(), layers[l].colors.end());
+		std::sort(colors.begin(), colors.end());
+		colors.erase(std::unique(colors.begin(), colors.end()), colors.end());
+
+		// Binary value of each ID for each layer (excluding layers are 1 for all colors but their own)
+		i32 words = ((i32)colors.size() + 1 + 63) / 64;
+		layerBits.resize(layers.size());
+		for (u32 l = 0; l < layers.size(); l++)
+		{
+			const Layer& layer = layers[l];
+			layerBits[l].assign(words, layer.include ? 0 : ~0ULL);
+			for (u32 c = 0; c < layer.colors.size(); c++)
+			{
+				u32 id = GetColorId(layer.colors[c]);
+				if (layer.include)
+					layerBits[l][id >> 6] |= 1ULL << (id & 63);
+				else
+					layerBits[l][id >> 6] &= ~(1ULL << (id & 63));
+			}
+		}
 
-	it = std::find(layer.colors.begin(), layer.colors.end(), c24);
+		// Convert the image (consecutive pixels often have the same color)
+		i32 pixelNum = img->imageX * img->imageY;
+		const u32* pixels = (const u32*)img->bits;
+		plane.resize(pixelNum);
+		u32 lastColor = 0;
+		u16 lastId = GetColorId(lastColor);
+		for (i32 i = 0; i < pixelNum; i++)
+		{
+			u32 c24 = 0xFFFFFF & pixels[i];
+			if (c24 != lastColor)
+			{
+				lastColor = c24;
+				lastId = GetColorId(c24);
+			}
+			plane[i] = lastId;
+		}
+	}
 
-	if (layer.include)
+	/// Get the ID of a color (0 if not used by any layer)
+	u16 GetColorId(u32 c24) const
 	{
-		return (it != layer.colors.end()) ? 1 : 0;
+		std::vector<u32>::const_iterator it = std::lower_bound(colors.begin(), colors.end(), c24);
+		if ((it == colors.end()) || (*it != c24))
+			return 0;
+		return (u16)(it - colors.begin() + 1);
 	}
-	else // if (layer.mode & LAYER_Exclude)
+
+	/// Get the binary value of a pixel according to layer configuration
+	inline i32 GetBinary(i32 layer, i32 idx) const
 	{
-		return (it == layer.colors.end()) ? 1 : 0;
+		u16 id = plane[idx];
+		return (layerBits[layer][id >> 6] >> (id & 63)) & 1;
 	}
-}
+};
 
 /// Export a 8x8 sprite data (1-bit per point)
-void ExportSpriteData(ExportParameters* param, ExporterInterface* exp, Layer& layer, i32 sid, i32 x, i32 y, BYTE* bits, i32 imageX, i32 imageY, std::vector<u8> &rawData)
+void ExportSpriteData(ExportParameters* param, ExporterInterface* exp, const LayerColorMap& colorMap, i32 layer, i32 sid, i32 x, i32 y, i32 imageX, i32 imageY, std::vector<u8> &rawData)
 {
 	if (param->comp != COMPRESS_RLEp)
 	{
@@ -1047,16 +2774,11 @@ void ExportSpriteData(ExportParameters* param, ExporterInterface* exp, Layer& la
 		u8 byte = 0;
 		if (((y + j) >= 0) || ((y + j) < imageY))
 		{
+			u8 values[8];
+			i32 idx = x + ((y + j) * imageX);
 			for (i32 i = 0; i < 8; i++)
-			{
-				if (((x + i) >= 0) || ((x + i) < imageX))
-				{
-					i32 idx = (x + i) + ((y + j) * imageX);
-					u32 c24 = 0xFFFFFF & ((u32*)bits)[idx];
-					if (ColorToBinary(layer, c24))
-						byte |= 1 << (7 - i);
-				}
-			}
+				values[i] = (u8)colorMap.GetBinary(layer, idx + i);
+			byte = PackPixels8(values);
 		}
 		if (param->comp == COMPRESS_RLEp)
 		{
@@ -1071,33 +2793,16 @@ void ExportSpriteData(ExportParameters* param, ExporterInterface* exp, Layer& la
 	}
 }
 
+/// Position of the 8x8 quadrants of a 16x16 sprite in the hardware order (0,2,1,3)
+static const i32 Sprite16Quadrants[4][2] = { { 0, 0 }, { 0, 8 }, { 8, 0 }, { 8, 8 } };
+
 /***/
-bool ExportSprite(ExportParameters* param, ExporterInterface* exp)
+bool ExportSprite(ExportParameters* param, const DecodedImage* img, ExporterInterface* exp)
 {
-	FIBITMAP* dib, * dib32;
 	u32 sid = 0; // sprite id
 	std::vector<u8> rawData;
-
-	//-------------------------------------------------------------------------
-	// Prepare image
-
-	dib = LoadImage(param->inFile.c_str()); // open and load the file using the default load option
-	if (dib == NULL)
-	{
-		printf("Error: Fail to load %s\n", param->inFile.c_str());
-		return false;
-	}
-
-	// Get 32 bits raw datas
-	dib32 = FreeImage_ConvertTo32Bits(dib);
-	FreeImage_Unload(dib); // free the original dib
-	i32 imageX = FreeImage_GetWidth(dib32);
-	i32 imageY = FreeImage_GetHeight(dib32);
-	i32 scanWidth = FreeImage_GetPitch(dib32);
-	i32 bpp = FreeImage_GetBPP(dib32);
-	BYTE* bits = new BYTE[scanWidth * imageY];
-	FreeImage_ConvertToRawBits(bits, dib32, scanWidth, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
-	FreeImage_Unload(dib32);
+	i32 imageX = img->imageX;
+	i32 imageY = img->imageY;
 
 	if (param->layers.size() == 0)
 	{
@@ -1112,6 +2817,10 @@ bool ExportSprite(ExportParameters* param, ExporterInterface* exp)
 		param->layers.push_back(l);
 	}
 
+	// Compile layers colors
+	LayerColorMap colorMap;
+	colorMap.Build(param->layers, img);
+
 	// File header
 	exp->WriteHeader();
 
@@ -1119,20 +2828,21 @@ bool ExportSprite(ExportParameters* param, ExporterInterface* exp)
 	// NAMES TABLE
 
 	exp->WriteTableBegin(TABLE_U8, param->tabName, "Sprites table");
+	bool bComments = exp->HasComments() && (param->comp != COMPRESS_RLEp);
 
 	// Parse image
 	for (i32 ny = 0; ny < param->numY; ny++)
 	{
 		for (i32 nx = 0; nx < param->numX; nx++)
 		{
-			if (param->comp != COMPRESS_RLEp)
+			if (bComments)
 				exp->WriteCommentLine(CMSX::Format("======== Frame[%i]", nx + ny * param->numX));
 
 			for (i32 l = 0; l < (i32)param->layers.size(); l++)
 			{
 				Layer& layer = param->layers[l];
 
-				if (param->comp != COMPRESS_RLEp)
+				if (bComments)
 					exp->WriteCommentLine(CMSX::Format("---- Layer[%i] (%s %i,%i %i,%i %s %i)", l, layer.size16 ? "16x16" : "8x8", layer.posX, layer.posY, layer.numX, layer.numY, layer.include ? "inc" : "dec", layer.colors.size()));
 
 				for (u32 j = 0; j < layer.numY; j++)
@@ -1143,20 +2853,14 @@ bool ExportSprite(ExportParameters* param, ExporterInterface* exp)
 						{
 							i32 x = param->posX + (nx * (param->sizeX + param->gapX)) + layer.posX + i * 16;
 							i32 y = param->posY + (ny * (param->sizeY + param->gapY)) + layer.posY + j * 16;
-							ExportSpriteData(param, exp, layer, sid++, x, y, bits, imageX, imageY, rawData);
-							y += 8;
-							ExportSpriteData(param, exp, layer, sid++, x, y, bits, imageX, imageY, rawData);
-							y -= 8;
-							x += 8;
-							ExportSpriteData(param, exp, layer, sid++, x, y, bits, imageX, imageY, rawData);
-							y += 8;
-							ExportSpriteData(param, exp, layer, sid++, x, y, bits, imageX, imageY, rawData);
+							for (i32 q = 0; q < 4; q++)
+								ExportSpriteData(param, exp, colorMap, l, sid++, x + Sprite16Quadrants[q][0], y + Sprite16Quadrants[q][1], imageX, imageY, rawData);
 						}
 						else // if (layer.mode & LAYER_8x8)
 						{
 							i32 x = param->posX + (nx * (param->sizeX + param->gapX)) + layer.posX + i * 8;
 							i32 y = param->posY + (ny * (param->sizeY + param->gapY)) + layer.posY + j * 8;
-							ExportSpriteData(param, exp, layer, sid++, x, y, bits, imageX, imageY, rawData);
+							ExportSpriteData(param, exp, colorMap, l, sid++, x, y, imageX, imageY, rawData);
 						}
 					}
 				}
@@ -1171,9 +2875,7 @@ bool ExportSprite(ExportParameters* param, ExporterInterface* exp)
 	}
 
 	i32 namesSize = exp->GetTotalBytes();
-	exp->WriteTableEnd(CMSX::Format("Names size: %i Bytes", namesSize));
-
-	delete bits;
+	exp->WriteTableEnd(exp->HasComments() ? CMSX::Format("Names size: %i Bytes", namesSize) : "");
 
 	//-------------------------------------------------------------------------
 	// Write file
@@ -1187,14 +2889,14 @@ bool ExportSprite(ExportParameters* param, ExporterInterface* exp)
 //-----------------------------------------------------------------------------
 
 /***/
-bool ParseImage(ExportParameters* param, ExporterInterface* exp)
+bool ParseImage(ExportParameters* param, const DecodedImage* img, ExporterInterface* exp)
 {
 	switch (param->mode)
 	{
 	default:
-	case MODE_Bitmap:	return ExportBitmap(param, exp);
-	case MODE_GM1:		return ExportGM1(param, exp);
-	case MODE_GM2:		return ExportGM2(param, exp);
-	case MODE_Sprite:	return ExportSprite(param, exp);
+	case MODE_Bitmap:	return ExportBitmap(param, img, exp);
+	case MODE_GM1:		return ExportGM1(param, img, exp);
+	case MODE_GM2:		return ExportGM2(param, img, exp);
+	case MODE_Sprite:	return ExportSprite(param, img, exp);
 	};
 }
\ No newline at end of file
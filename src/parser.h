@@ -13,8 +13,96 @@
 #include "types.h"
 #include "exporter.h"
 
+// Get the index of the palette entry nearest to the given color (exact linear search)
+u8 GetNearestColorIndex(u32 color, const u32* pal, i32 count);
+
+/// Palette prepared for the vectorized nearest color search (16-bits per component, one array per component)
+struct NearestColorPalette
+{
+	static const i16 DISABLED = 0x400;	///< Component value of the entries excluded from the search (can never be the nearest)
+
+	i16 R[16];
+	i16 G[16];
+	i16 B[16];
+
+	NearestColorPalette() { Set(NULL, -1); }
+
+	// Set the palette entries to search in (same entries than GetNearestColorIndex)
+	void Set(const u32* pal, i32 count);
+};
+
+// Get the index of the palette entry nearest to the given color (use the fastest kernel supported by the CPU)
+u8 SearchNearestColor(u32 color, const NearestColorPalette* pal);
+
+// Get the index of the palette entry nearest to each color of a row of pixels
+void SearchNearestColorRow(const u32* colors, i32 num, const NearestColorPalette* pal, u8* indices);
+
+/// Nearest palette color lookup table (indexed by 18-bits quantized RGB)
+struct PaletteLUT
+{
+	static const u8 REFINE = 0xFF;	///< Table entry of cells crossed by a color boundary
+
+	NearestColorPalette nearest;	///< Palette entries used for exact search
+	std::vector<u8> table;			///< Nearest index for each 6-6-6 bits RGB cell (or REFINE). Empty if the table is not used.
+
+	// Prepare the search for the given palette (table is only worth to build for palette used on many images)
+	void Build(const u32* pal, i32 count, bool bTable);
+
+	/// Get the index of the palette entry nearest to the given color
+	u8 GetNearestIndex(u32 color) const
+	{
+		if (!table.empty())
+		{
+			u8 idx = table[((color >> 6) & 0x3F000) | ((color >> 4) & 0x00FC0) | ((color >> 2) & 0x0003F)];
+			if (idx != REFINE)
+				return idx;
+		}
+		return SearchNearestColor(color, &nearest);
+	}
+
+	// Get the index of the palette entry nearest to each color of a row of pixels
+	void GetNearestIndexRow(const u32* colors, i32 num, u8* indices) const;
+};
+
+/// Opacity bitmap (1 bit per pixel, set for each pixel that is not of the transparency color)
+struct OpacityMask
+{
+	std::vector<u64> words;			///< Pixel N is stored in bit (N & 63) of word (N >> 6)
+
+	// Build the mask from 32-bits pixels
+	void Build(const u32* pixels, i32 num, u32 transRGB);
+
+	/// Check if a pixel is opaque
+	bool IsOpaque(i32 pixel) const { return ((words[pixel >> 6] >> (pixel & 63)) & 1) != 0; }
+
+	// Get the first and last opaque pixels of a range (relative to the range start)
+	bool GetBounds(i32 start, i32 num, i32& first, i32& last) const;
+};
+
+/// Decoded input image (32-bits RGBA plane, custom palette and converted color planes)
+struct DecodedImage
+{
+	i32 imageX;					///< Image width
+	i32 imageY;					///< Image height
+	i32 scanWidth;				///< Size of a line in bytes
+	BYTE* bits;					///< 32-bits raw data (top-down)
+	u32 customPalette[16];		///< Custom palette (only valid if palType is PALETTE_Custom)
+	PaletteLUT paletteLUT;		///< Nearest color lookup table of the palette used by the exporter
+	std::vector<u8> plane;		///< Value written by the bitmap exporter for each pixel (GRB8, palette index or 1-bit value)
+	OpacityMask opacity;		///< Opacity bit of each pixel
+
+	DecodedImage() : imageX(0), imageY(0), scanWidth(0), bits(NULL) { memset(customPalette, 0, sizeof(customPalette)); }
+	~DecodedImage() { delete[] bits; }
+};
+
+// Load the input file and convert it to the format needed by the exporters (must be done only once per input file)
+bool DecodeImage(ExportParameters* param, DecodedImage* img);
+
+// Compute in a single pass the exact data size ExportBitmap would generate with each of the given compressors
+bool GetBitmapSizes(ExportParameters* param, const DecodedImage* img, const CMSXi_Compressor* compTable, i32 compCount, u32* sizes);
+
 //
-bool ParseImage(ExportParameters* param, ExporterInterface* exp);
+bool ParseImage(ExportParameters* param, const DecodedImage* img, ExporterInterface* exp);
 
 // Build 256 colors palette
 void Create256ColorsPalette(const char* filename);